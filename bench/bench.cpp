@@ -0,0 +1,243 @@
+/* Benchmarks of serialization, call round trips, stub compilation and server throughput */
+/* Build with `scons bench` or `bjam bench`, after the library.
+ * Run as: `bench [-quick] [name-prefix]`. Prints one JSON object per line per measurement, eg.
+ *   {"bench":"roundtrip","server":"reactor","transport":"tcp","bytes":1024,"iterations":20000,"ns_per_op":41230,"ops_per_sec":24254,"p50_us":38,"p99_us":77}
+ * so runs can be diffed or loaded into a spreadsheet to catch regressions. Progress and diagnostics go to stderr. */
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <10util/util.h>
+#include "remote.h"
+#include "reactor.h"
+#include "stubcache.h"
+#include "pool.h"
+
+using namespace std;
+
+const module::Module split_string_module ("10util", "10util/util.h");
+
+static double minSeconds = 1;  // run each measurement at least this long
+static string only;  // run only benchmarks whose name starts with this
+
+static long long now () {
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return (long long) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/** One line of output, fields added in order */
+class Result {
+	ostringstream out;
+public:
+	Result (string bench) {out << "{\"bench\":\"" << bench << "\"";}
+	Result& field (string name, string value) {out << ",\"" << name << "\":\"" << value << "\""; return *this;}
+	Result& field (string name, double value) {out << ",\"" << name << "\":" << value; return *this;}
+	void print () {cout << out.str() << "}" << endl;}
+};
+
+static bool selected (string bench) {
+	return bench.compare (0, only.size(), only) == 0;
+}
+
+/** Run op until minSeconds passed, timing each run. Add timing fields to result */
+static void measure (Result &r, boost::function0<void> op) {
+	vector<long long> times;
+	long long start = now(), end = start + (long long) (minSeconds * 1e9), t = start;
+	while (t < end) {
+		op();
+		long long t2 = now();
+		times.push_back (t2 - t);
+		t = t2;
+	}
+	sort (times.begin(), times.end());
+	r.field ("iterations", times.size());
+	r.field ("ns_per_op", (double) (t - start) / times.size());
+	r.field ("ops_per_sec", times.size() / ((t - start) / 1e9));
+	r.field ("p50_us", times [times.size() / 2] / 1000.0);
+	r.field ("p99_us", times [times.size() * 99 / 100] / 1000.0);
+}
+
+/* Serialization */
+
+static remote::Closure closure (unsigned args, unsigned bytes) {
+	remote::Closure c (FUN(split_string).closure.fun);
+	for (unsigned i = 0; i < args; i++) c.addArg (string (bytes, 'x'));
+	return c;
+}
+
+static void encode (const remote::Closure &c) {io::encode (c);}
+static void decode (const io::Code &code) {io::decode<remote::Closure> (code);}
+
+static void benchSerialization () {
+	unsigned argss[] = {0, 1, 4, 16};
+	unsigned bytess[] = {8, 1024, 65536};
+	for (unsigned a = 0; a < 4; a++)
+		for (unsigned b = 0; b < 3; b++) {
+			if (argss[a] == 0 && b > 0) continue;
+			remote::Closure c = closure (argss[a], bytess[b]);
+			Result e ("encode");
+			e.field ("args", argss[a]) .field ("bytes", bytess[b]);
+			measure (e, boost::bind (encode, boost::cref (c)));
+			e.print();
+			io::Code code = io::encode (c);
+			Result d ("decode");
+			d.field ("args", argss[a]) .field ("bytes", bytess[b]);
+			measure (d, boost::bind (decode, boost::cref (code)));
+			d.print();
+		}
+}
+
+/* Round trip */
+
+static io::Code echo (io::Code request) {return request;}
+
+static const network::Port ThreadedPort = 17101, ReactorPort = 17102;
+
+static void startServers () {
+	static bool started = false;
+	if (started) return;
+	started = true;
+	call::listen (ThreadedPort, echo);
+	call::listenLocal (call::localPath (ThreadedPort), echo);
+	call::ServerOptions options;
+	options.localPath = call::localPath (ReactorPort);
+	call::serve (ReactorPort, echo, options);
+	boost::this_thread::sleep (boost::posix_time::milliseconds (100));
+}
+
+static void roundTrip (network::HostPort hp, const io::Code &request) {call::call (hp, request);}
+
+static void benchRoundTrip () {
+	startServers();
+	network::Port ports[] = {ThreadedPort, ReactorPort};
+	unsigned bytess[] = {8, 1024, 65536};
+	for (unsigned local = 0; local < 2; local++) {
+		call::useLocal = local;
+		pool::clear();
+		for (unsigned p = 0; p < 2; p++)
+			for (unsigned b = 0; b < 3; b++) {
+				Result r ("roundtrip");
+				r.field ("server", p == 0 ? "threaded" : "reactor") .field ("transport", local ? "unix" : "tcp") .field ("bytes", bytess[b]);
+				measure (r, boost::bind (roundTrip, network::HostPort ("localhost", ports[p]), io::Code (string (bytess[b], 'x'))));
+				r.print();
+			}
+	}
+	call::useLocal = true;
+	pool::clear();
+}
+
+/* Throughput */
+
+static void client (network::HostPort hp, long long end, long long &calls) {
+	io::Code request ("x");
+	while (now() < end) {
+		call::call (hp, request);
+		calls++;
+	}
+}
+
+static void benchThroughput () {
+	startServers();
+	network::Port ports[] = {ThreadedPort, ReactorPort};
+	unsigned clientss[] = {1, 4, 16, 64};
+	for (unsigned p = 0; p < 2; p++)
+		for (unsigned c = 0; c < 4; c++) {
+			unsigned clients = clientss[c];
+			pool::options.maxConnections = clients;
+			vector<long long> calls (clients, 0);
+			long long start = now(), end = start + (long long) (minSeconds * 1e9);
+			boost::thread_group threads;
+			for (unsigned i = 0; i < clients; i++)
+				threads.create_thread (boost::bind (client, network::HostPort ("localhost", ports[p]), end, boost::ref (calls[i])));
+			threads.join_all();
+			long long total = 0;
+			for (unsigned i = 0; i < clients; i++) total += calls[i];
+			Result r ("throughput");
+			r.field ("server", p == 0 ? "threaded" : "reactor") .field ("transport", call::useLocal ? "unix" : "tcp") .field ("clients", clients) .field ("calls", total) .field ("ops_per_sec", total / ((now() - start) / 1e9));
+			r.print();
+		}
+}
+
+/* Stub compilation and eval */
+
+/** Load stub of split_string from stub directory and print milliseconds it took. Run as `bench -load-stub dir` by benchCompile, since a process that loaded a stub once gets it back from dlopen without loading it again */
+static int loadStub (string dir) {
+	stubcache::directory = dir;
+	long long t = now();
+	_function::compileFunction0c (FUN(split_string).closure.fun);
+	cout << (now() - t) / 1e6 << endl;
+	return 0;
+}
+
+/** Milliseconds a new process of this program takes to load the stub in dir, or -1 if it failed */
+static double loadStubInChild (string dir) {
+	char self [4096];
+	ssize_t n = readlink ("/proc/self/exe", self, sizeof self - 1);
+	if (n <= 0) return -1;
+	self[n] = '\0';
+	FILE *child = popen (("'" + string (self) + "' -load-stub " + dir) .c_str(), "r");
+	if (!child) return -1;
+	double ms = -1;
+	if (fscanf (child, "%lf", &ms) != 1) ms = -1;
+	if (pclose (child) != 0) ms = -1;
+	return ms;
+}
+
+static void benchCompile () {
+	char dir[] = "/tmp/10remote-bench-XXXXXX";
+	if (!mkdtemp (dir)) {cerr << "Cannot create temporary stub directory" << endl; return;}
+	string saved = stubcache::directory;
+	stubcache::directory = dir;
+	remote::FunctionId fun = FUN(split_string).closure.fun;
+	long long t = now();
+	_function::compileFunction0c (fun);
+	Result cold ("compile");
+	cold.field ("stub", "cold") .field ("ms", (now() - t) / 1e6);
+	cold.print();
+	double ms = loadStubInChild (dir);
+	if (ms < 0) cerr << "Cannot load stub from " << dir << " in a new process" << endl;
+	else {
+		Result disk ("compile");
+		disk.field ("stub", "disk") .field ("ms", ms);
+		disk.print();
+	}
+	stubcache::directory = saved;
+	if (system (("rm -rf " + string (dir)) .c_str()) != 0) cerr << "Cannot remove " << dir << endl;
+}
+
+static void eval (remote::Host host) {remote::eval (remote::bind (FUN(split_string), ' ', string ("hello world")), host);}
+
+static void benchEval () {
+	static const network::Port EvalPort = 17103;
+	remote::listen ("localhost:" + to_string (EvalPort));
+	boost::this_thread::sleep (boost::posix_time::milliseconds (100));
+	remote::Host host = "localhost:" + to_string (EvalPort);
+	long long t = now();
+	eval (host); // first call loads stub, compiling it unless in stub cache
+	Result first ("eval");
+	first.field ("call", "first") .field ("ms", (now() - t) / 1e6);
+	first.print();
+	Result warm ("eval");
+	warm.field ("call", "warm");
+	measure (warm, boost::bind (eval, host));
+	warm.print();
+}
+
+int main (int argc, const char* argv[]) {
+	for (int i = 1; i < argc; i++) {
+		if (string (argv[i]) == "-load-stub" && i + 1 < argc) return loadStub (argv[i + 1]);
+		if (string (argv[i]) == "-quick") minSeconds = 0.1;
+		else only = argv[i];
+	}
+	if (selected ("encode") || selected ("decode")) benchSerialization();
+	if (selected ("roundtrip")) benchRoundTrip();
+	if (selected ("throughput")) benchThroughput();
+	if (selected ("compile")) benchCompile();
+	if (selected ("eval")) benchEval();
+	_exit (0); // servers are still listening
+}
@@ -0,0 +1,68 @@
+/* Encoded arguments of a closure, kept end to end in one buffer instead of one string per argument. Binding an argument appends to the buffer in place, and the whole buffer is serialized as one block.
+ * Header only, since compiled function stubs decode their arguments with it. */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <boost/cstdint.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+#include <10util/io.h>
+
+namespace remote {
+
+struct Args {
+	friend std::ostream& operator<< (std::ostream& out, const Args &x) {
+		out << "[";
+		for (unsigned i = 0; i < x.size(); i++) out << (i > 0 ? ", " : "") << x[i];
+		out << "]";
+		return out;
+	}
+
+	std::string buffer;  // encoded args end to end
+	std::vector<boost::uint32_t> ends;  // offset in buffer just past each arg
+
+	Args () {}
+
+	unsigned size () const {return ends.size();}
+	bool empty () const {return ends.empty();}
+
+	/** Make room for more args of given total encoded size without reallocating */
+	void reserve (unsigned count, size_t bytes) {
+		ends.reserve (ends.size() + count);
+		buffer.reserve (buffer.size() + bytes);
+	}
+
+	/** Append encoded arg */
+	void push_back (const io::Code &code) {
+		buffer.append (code.data);
+		ends.push_back (buffer.size());
+	}
+
+	/** Append arg encoded */
+	template <class A> void add (const A &arg) {push_back (io::encode (arg));}
+
+	/** Offset of arg i in buffer */
+	size_t begin (unsigned i) const {return i == 0 ? 0 : ends[i-1];}
+
+	/** Arg i still encoded */
+	io::Code operator[] (unsigned i) const {return io::Code (buffer.substr (begin (i), ends[i] - begin (i)));}
+
+	/** Arg i decoded as a T */
+	template <class T> T get (unsigned i) const {return io::decode<T> ((*this)[i]);}
+};
+
+}
+
+/* Serialization */
+
+namespace boost {namespace serialization {
+
+template <class Archive> void serialize (Archive & ar, remote::Args & x, const unsigned version) {
+	ar & x.buffer;
+	ar & x.ends;
+}
+
+}}
@@ -0,0 +1,71 @@
+#include "batch.h"
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+const module::Module batch::module (items<std::string>("10remote", "10util"), "10remote/batch.h");
+
+unsigned batch::parallelism = std::max (1u, boost::thread::hardware_concurrency());
+
+/** Run closure unless this thread's deadline passed */
+static void runOne (remote::Closure closure, batch::Result* result) {
+	try {
+		if (deadline::active() && deadline::remaining() <= 0) throw call::Timeout ("Deadline passed before closure ran");
+		*result = batch::Result (closure ());
+	} catch (std::exception &e) {*result = batch::Result (call::Exception (e));}
+}
+
+/** Closures of a parallel batch and their results, held by its runners too so they may outlive a `run` that was interrupted */
+struct ParallelRun {
+	const std::vector<remote::Closure> closures;
+	std::vector<batch::Result> results;
+	const deadline::Context callerDeadline;
+	const trace::Context callerTrace;
+	boost::mutex mutex;  // guards next
+	unsigned next;
+	ParallelRun (const std::vector<remote::Closure> &closures) : closures(closures), results(closures.size()),
+		callerDeadline(deadline::current()), callerTrace(trace::current()), next(0) {}
+	/** Index of next closure to run, or false if none left */
+	bool take (unsigned &i) {
+		boost::lock_guard<boost::mutex> lock (mutex);
+		if (next == closures.size()) return false;
+		i = next++;
+		return true;
+	}
+};
+
+/** Run closures not taken by another runner yet, until none are left, under the caller's deadline and trace */
+static void runAll (boost::shared_ptr<ParallelRun> run) {
+	deadline::Adopt timing (run->callerDeadline);
+	trace::Adopt tracing (run->callerTrace);
+	unsigned i;
+	while (run->take (i)) runOne (run->closures[i], &run->results[i]);
+}
+
+std::vector<batch::Result> batch::run (std::vector<remote::Closure> closures, bool parallel) {
+	std::vector<Result> results (closures.size());
+	if (!parallel) {
+		for (unsigned i = 0; i < closures.size(); i++) runOne (closures[i], &results[i]);
+		return results;
+	}
+	boost::shared_ptr<ParallelRun> run (new ParallelRun (closures));
+	unsigned runners = std::min ((size_t) std::max (parallelism, 1u), closures.size());
+	boost::thread_group threads;
+	for (unsigned r = 0; r < runners; r++)
+		threads.create_thread (boost::bind (runAll, run));
+	try {threads.join_all ();}
+	catch (boost::thread_interrupted&) { // deadline passed or cancelled: runners stop at their next interruption point
+		threads.interrupt_all ();
+		throw;
+	}
+	return run->results;
+}
+
+std::vector< Either <call::Exception, io::Code> > remote::evalBatch (std::vector<Closure> closures, Host host, bool parallel) {
+	std::vector<batch::Result> results = eval (bind (MFUN(batch,run), closures, parallel), host);
+	std::vector< Either <call::Exception, io::Code> > outcomes;
+	for (unsigned i = 0; i < results.size(); i++)
+		if (results[i].ok) outcomes.push_back (Right<call::Exception> (results[i].value));
+		else outcomes.push_back (Left<io::Code> (results[i].error));
+	return outcomes;
+}
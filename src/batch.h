@@ -0,0 +1,63 @@
+/* Evaluate many closures on a host in one round trip. Each closure's exception is returned with its result instead of aborting the rest of the batch. */
+
+#pragma once
+
+#include <vector>
+#include <10util/either.h>
+#include "remote.h"
+
+namespace batch {
+
+	extern const module::Module module;
+
+	/** Outcome of one closure: its encoded result, or the exception it raised */
+	struct Result {
+		bool ok;
+		io::Code value;
+		call::Exception error;
+		Result (io::Code value) : ok(true), value(value) {}
+		Result (call::Exception error) : ok(false), error(error) {}
+		Result () : ok(false) {} // for serialization
+	};
+
+	/** Closures of a parallel batch run at once, by that many threads. Default number of cores */
+	extern unsigned parallelism;
+
+	/** Run closures on this machine, one after another in order, or `parallelism` at a time if parallel. Under the caller's deadline: closures not started before it passed fail with call::Timeout */
+	std::vector<Result> run (std::vector<remote::Closure> closures, bool parallel);
+
+}
+
+namespace remote {
+
+	/** Evaluate closures on host in one request, in order or several at once if parallel (see batch::parallelism on host). Return each one's encoded result or exception, in the same order as closures */
+	std::vector< Either <call::Exception, io::Code> > evalBatch (std::vector<Closure> closures, Host host, bool parallel = false);
+
+	/** Same as above for actions of one type. The result of a void action is Unit */
+	template <class O> std::vector< Either <call::Exception, typename future::Slot<O>::type> > evalBatch (std::vector< Function0<O> > actions, Host host, bool parallel = false) {
+		typedef typename future::Slot<O>::type Value;
+		std::vector<Closure> closures;
+		for (unsigned i = 0; i < actions.size(); i++) closures.push_back (actions[i].closure);
+		std::vector< Either <call::Exception, io::Code> > codes = evalBatch (closures, host, parallel);
+		std::vector< Either <call::Exception, Value> > results;
+		for (unsigned i = 0; i < codes.size(); i++) {
+			boost::optional<io::Code> code = codes[i].mRight();
+			if (code) results.push_back (Right<call::Exception> (io::decode<Value> (*code)));
+			else results.push_back (Left<Value> (*codes[i].mLeft()));
+		}
+		return results;
+	}
+
+}
+
+/* Serialization */
+
+namespace boost {namespace serialization {
+
+template <class Archive> void serialize (Archive & ar, batch::Result & x, const unsigned version) {
+	ar & x.ok;
+	ar & x.value;
+	ar & x.error;
+}
+
+}}
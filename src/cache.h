@@ -0,0 +1,116 @@
+/* Map from key to a value that is expensive to compute (eg. a compiled function), safe for concurrent use by many threads.
+ * Lookup of a loaded value only takes a shared lock. When several threads miss on the same key at once, one computes the value and the rest wait for it instead of computing it again. */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <stdexcept>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/exceptions.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+namespace cache {
+
+/** Snapshot of a cache's counters */
+struct Stats {
+	long hits;  // found already loaded
+	long misses;  // loaded by calling thread
+	long waits;  // waited on another thread loading the same key
+	Stats (long hits, long misses, long waits) : hits(hits), misses(misses), waits(waits) {}
+	Stats () : hits(0), misses(0), waits(0) {}
+};
+
+template <class K, class V> class Cache {
+	/** Load in progress, shared by threads waiting on it */
+	struct Pending {
+		bool done;
+		boost::shared_ptr<V> value;  // null if load failed
+		boost::exception_ptr error;  // raised by load
+		boost::condition_variable finished;
+		Pending () : done(false) {}
+	};
+	boost::shared_mutex loadedMutex;
+	std::map < K, boost::shared_ptr<V> > loaded;
+	boost::mutex pendingMutex;
+	std::map < K, boost::shared_ptr<Pending> > pending;
+	boost::detail::atomic_count hits, misses, waits;
+
+	/** Hand outcome of load to threads waiting on it */
+	void finish (const K &key, boost::shared_ptr<Pending> p, boost::shared_ptr<V> value, boost::exception_ptr error) {
+		{
+			boost::unique_lock<boost::mutex> lock (pendingMutex);
+			p->value = value;
+			p->error = error;
+			p->done = true;
+			pending.erase (key);
+		}
+		p->finished.notify_all ();
+	}
+
+	Cache (const Cache&);  // not copyable
+	void operator= (const Cache&);
+public:
+	Cache () : hits(0), misses(0), waits(0) {}
+
+	/** Loaded value of key, or null */
+	boost::shared_ptr<V> find (const K &key) {
+		boost::shared_lock<boost::shared_mutex> lock (loadedMutex);
+		typename std::map < K, boost::shared_ptr<V> >::const_iterator it = loaded.find (key);
+		return it == loaded.end() ? boost::shared_ptr<V>() : it->second;
+	}
+
+	/** Set value of key, replacing any loaded value */
+	void insert (const K &key, boost::shared_ptr<V> value) {
+		boost::unique_lock<boost::shared_mutex> lock (loadedMutex);
+		loaded [key] = value;
+	}
+
+	/** Value of key, calling load to compute it if not loaded yet. Concurrent callers on the same key share one call of load, and all get its exception if it fails. If the loading thread is interrupted instead, a waiting caller loads it again */
+	boost::shared_ptr<V> get (const K &key, boost::function0< boost::shared_ptr<V> > load) {
+		boost::shared_ptr<V> value = find (key);
+		if (value) {++hits; return value;}
+		boost::shared_ptr<Pending> p;
+		{
+			boost::unique_lock<boost::mutex> lock (pendingMutex);
+			for (;;) {
+				value = find (key); // may have finished loading since we looked
+				if (value) {++hits; return value;}
+				typename std::map < K, boost::shared_ptr<Pending> >::iterator it = pending.find (key);
+				if (it == pending.end()) break;
+				++waits;
+				p = it->second;
+				while (!p->done) p->finished.wait (lock);
+				if (p->error) boost::rethrow_exception (p->error);
+				if (p->value) return p->value;
+				// loading thread was interrupted or unwound, so load it ourselves
+			}
+			++misses;
+			p = boost::shared_ptr<Pending> (new Pending);
+			pending [key] = p;
+		}
+		try {
+			value = load ();
+			if (!value) throw std::runtime_error ("Load returned nothing");
+		} catch (boost::thread_interrupted&) { // ours, not the waiters'
+			finish (key, p, value, boost::exception_ptr());
+			throw;
+		} catch (...) { // a forced unwind has no exception_ptr, so waiters load it themselves as if interrupted
+			finish (key, p, value, boost::current_exception());
+			throw;
+		}
+		insert (key, value);
+		finish (key, p, value, boost::exception_ptr());
+		return value;
+	}
+
+	Stats stats () const {return Stats (hits, misses, waits);}
+};
+
+}
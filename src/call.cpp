@@ -1,22 +1,159 @@
 // This implementation expects io::Code, call::Exception, and Either to print to ostream in a readable format (istream).
 
 #include "call.h"
+#include "frame.h"
+#include "compression.h"
+#include "streaming.h"
+#include "metrics.h"
+#include "executor.h"
 #include <exception>
+#include <map>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/asio.hpp>
 #include <10util/either.h>
+#include <10util/util.h> // to_string
 #include <ios>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
 
-/** Respond to requests from socket one at a time using supplied respond function */
+bool call::useFrames = true;
+bool call::useLocal = true;
+unsigned call::concurrentThreads = 64;
+
+/** State shared by the threads answering one framed connection */
+struct FramedConnection {
+	io::IOStream stream;
+	bool compress;  // large bodies
+	boost::mutex writeMutex;
+	streaming::Registry streams;
+	boost::mutex flightMutex;  // guards inFlight
+	boost::condition_variable landed;
+	unsigned inFlight;  // concurrent requests queued or running
+	FramedConnection (io::IOStream stream, bool compress) : stream(stream), compress(compress), inFlight(0) {}
+	/** Count a concurrent request, first waiting while call::concurrentThreads are in flight */
+	void enter () {
+		boost::unique_lock<boost::mutex> lock (flightMutex);
+		while (inFlight >= std::max (1u, call::concurrentThreads)) landed.wait (lock);
+		inFlight++;
+	}
+	void leave () {
+		{
+			boost::lock_guard<boost::mutex> lock (flightMutex);
+			inFlight--;
+		}
+		landed.notify_one();
+	}
+	/** Write frame under write lock. Throw if connection closed */
+	void send (frame::Type type, boost::uint32_t id, std::string body) {
+		boost::uint8_t flags = compress && compression::pack (body) ? frame::Compressed : 0;
+		boost::lock_guard<boost::mutex> lock (writeMutex);
+		frame::write (*stream, type, flags, id, body);
+		stream->flush();
+		if (! *stream) throw std::runtime_error ("Connection to client closed");
+	}
+};
+
+/** Apply respond function to request and write its response (or exception). A Streamed request's chunks are written as it produces them */
+static void respondFrame (boost::function1 <call::Response, call::Request> respond, boost::shared_ptr<FramedConnection> c, boost::uint32_t id, boost::uint8_t flags, call::Request request) {
+	// catch any exception in respond function and return it to remote caller to be raised there
+	metrics::Running running;
+	frame::Type type = frame::Response;
+	std::string body;
+	try {
+		if (flags & frame::Compressed) compression::unpack (request.data);
+		if (flags & frame::Streamed) {
+			streaming::Scope scope (boost::bind (&FramedConnection::send, c, frame::Chunk, id, _1), c->streams.open (id));
+			body = respond (request) .data;
+		} else
+			body = respond (request) .data;
+	} catch (std::exception &e) {
+		type = frame::Error;
+		body = frame::encodeError (call::Exception (e));
+	}
+	if (flags & frame::Streamed) c->streams.close (id);
+	try {c->send (type, id, body);}
+	catch (std::exception &e) {} // connection closed, reader will notice
+}
+
+static executor::Executor *concurrent;
+static boost::once_flag concurrentStarted = BOOST_ONCE_INIT;
+
+/** Never stopped, as listeners run for the life of the process */
+static void startConcurrent () {
+	concurrent = new executor::Executor (std::max (1u, call::concurrentThreads));
+}
+
+static void respondConcurrent (boost::function1 <call::Response, call::Request> respond, boost::shared_ptr<FramedConnection> c, boost::uint32_t id, boost::uint8_t flags, call::Request request) {
+	try {respondFrame (respond, c, id, flags, request);}
+	catch (boost::thread_interrupted&) {
+		c->leave();
+		throw;
+	}
+	c->leave();
+}
+
+/** Respond to framed requests from socket using supplied respond function. Requests flagged Concurrent or Streamed go to the shared pool of threads and may be answered out of order, others are answered one at a time in order */
+static void respondFrames (boost::function1 <call::Response, call::Request> respond, io::IOStream stream, bool compress) {
+	boost::shared_ptr<FramedConnection> c (new FramedConnection (stream, compress));
+	frame::Header header;
+	call::Request request;
+	try {
+		while (frame::read (*stream, header, request.data)) {
+			if (header.type == frame::Ping) {
+				c->send (frame::Ping, header.id, "");
+				continue;
+			}
+			if (header.type == frame::Credit) {
+				c->streams.grant (header.id, frame::decodeCredit (request.data));
+				continue;
+			}
+			if (header.type != frame::Request) throw std::runtime_error ("Unexpected frame type " + to_string ((unsigned) header.type));
+			if (header.flags & (frame::Concurrent | frame::Streamed)) {
+				boost::call_once (startConcurrent, concurrentStarted);
+				c->enter(); // backpressure: stop reading this client while it has enough requests in flight
+				concurrent->submit (boost::bind (respondConcurrent, respond, c, header.id, header.flags, request), header.flags & frame::Bulk ? executor::Bulk : executor::Interactive);
+			} else
+				respondFrame (respond, c, header.id, header.flags, request);
+		}
+	} catch (std::exception &e) {
+		c->streams.closeAll(); // fail streamed calls waiting for credits
+		throw;
+	}
+	c->streams.closeAll();
+}
+
+/** Respond to requests from socket one at a time using supplied respond function. Switch to frames if client asks */
 static void respondLoop (boost::function1 <call::Response, call::Request> respond, io::IOStream stream) {
+	metrics::opened();
 	try {
+		std::string refused;  // client speaks another version
 		for (;;) {
 			call::Request request;
 			*stream >> request;
+			if (!refused.empty() || frame::isOtherHello (request.data, refused)) {
+				*stream << Left<call::Response> (call::Exception (refused));
+				continue;
+			}
+			bool compress, handles;
+			if (frame::isHello (request.data, compress, handles)) {
+				compress = compress && compression::enabled;
+				*stream << Right<call::Exception> (call::Response (frame::helloAck (compress, handles && call::servesHandles)));
+				stream->flush();
+				respondFrames (respond, stream, compress);
+				break;
+			}
 			// catch any exception in respond function and return it to remote caller to be raised there
 			Either <call::Exception, call::Response> reply;
-			try {reply = Right<call::Exception> (respond (request));}
-			catch (std::exception &e) {reply = Left<call::Response> (call::Exception (e));}
+			{
+				metrics::Running running;
+				try {reply = Right<call::Exception> (respond (request));}
+				catch (std::exception &e) {reply = Left<call::Response> (call::Exception (e));}
+			}
 			*stream << reply;
 		}
 	} catch (std::exception &e) {
@@ -25,6 +162,7 @@ static void respondLoop (boost::function1 <call::Response, call::Request> respon
 			std::cerr << "connection to client aborted: (" << typeName(e) << ") " << e.what() << std::endl;
 		// else client closed connection
 	}
+	metrics::closed();
 }
 
 static void acceptClient (boost::function1 <call::Response, call::Request> respond, io::IOStream sock) {
@@ -36,13 +174,192 @@ boost::shared_ptr<boost::thread> call::listen (network::Port port, boost::functi
 	return network::listen (port, boost::bind (acceptClient, respond, _1));
 }
 
-/** Send request over connection and wait for response. Other end of connection must be listening, see above.
- * Not thread safe */
-call::Response call::call (io::IOStream stream, Request request) {
+static void acceptLocal (boost::function1 <call::Response, call::Request> respond, boost::shared_ptr<boost::asio::local::stream_protocol::acceptor> acceptor) {
+	try {
+		for (;;) {
+			boost::shared_ptr<boost::asio::local::stream_protocol::iostream> stream (new boost::asio::local::stream_protocol::iostream);
+			acceptor->accept (*stream->rdbuf());
+			acceptClient (respond, stream);
+		}
+	} catch (std::exception &e) {
+		std::cerr << "stopped listening: (" << typeName(e) << ") " << e.what() << std::endl;
+	}
+}
+
+boost::shared_ptr<boost::thread> call::listenLocal (std::string path, boost::function1 <Response, Request> respond) {
+	static boost::asio::io_service service;
+	claimLocal (path);
+	boost::shared_ptr<boost::asio::local::stream_protocol::acceptor> acceptor (new boost::asio::local::stream_protocol::acceptor (service, boost::asio::local::stream_protocol::endpoint (path)));
+	return boost::shared_ptr<boost::thread> (new boost::thread (boost::bind (acceptLocal, respond, acceptor)));
+}
+
+/** Directory of this user's sockets at `localPath`, private to the user so nobody else can listen there */
+static std::string localDirectory () {
+	const char* runtime = getenv ("XDG_RUNTIME_DIR");
+	if (runtime && *runtime) return std::string (runtime) + "/10remote";
+	return "/tmp/10remote-" + to_string (geteuid());
+}
+
+std::string call::localPath (network::Port port) {
+	return localDirectory() + "/" + to_string (port) + ".sock";
+}
+
+static bool isThisMachine (const std::string &hostname) {
+	if (hostname == "localhost" || hostname == "127.0.0.1") return true;
+	boost::system::error_code error;
+	if (hostname == boost::asio::ip::host_name (error)) return true;
+	try {return hostname == network::myHostname();}
+	catch (std::exception &e) {return false;} // not initialized
+}
+
+/** Connection to Unix domain socket at path, or null if nobody listens there, or if ownPeer and the server runs as another user */
+static io::IOStream connectLocal (std::string path, bool ownPeer = false) {
+	boost::shared_ptr<boost::asio::local::stream_protocol::iostream> stream (new boost::asio::local::stream_protocol::iostream (boost::asio::local::stream_protocol::endpoint (path)));
+	if (! *stream) return io::IOStream();
+	if (ownPeer) {
+		struct ucred peer;
+		socklen_t size = sizeof peer;
+		if (getsockopt (stream->socket().native_handle(), SOL_SOCKET, SO_PEERCRED, &peer, &size) != 0 || peer.uid != geteuid()) return io::IOStream();
+	}
+	return stream;
+}
+
+void call::claimLocal (std::string path) {
+	std::string dir = localDirectory();
+	if (path.compare (0, dir.size() + 1, dir + "/") == 0) {
+		if (mkdir (dir.c_str(), 0700) != 0 && errno != EEXIST) throw std::runtime_error ("Cannot create " + dir);
+		struct stat st;
+		if (lstat (dir.c_str(), &st) != 0 || !S_ISDIR (st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077))
+			throw std::runtime_error (dir + " must be a directory private to this user");
+	}
+	if (connectLocal (path)) throw std::runtime_error ("Another server listens on " + path);
+	unlink (path.c_str());
+}
+
+/** Open new connection to server, through its Unix domain socket if it is on this machine and has one */
+static io::IOStream connectTo (network::HostPort hostPort) {
+	if (hostPort.hostname.compare (0, call::LocalPrefix.size(), call::LocalPrefix) == 0) {
+		std::string path = hostPort.hostname.substr (call::LocalPrefix.size());
+		io::IOStream stream = connectLocal (path);
+		if (!stream) throw std::runtime_error ("Cannot connect to " + hostPort.hostname);
+		return stream;
+	}
+	if (call::useLocal && isThisMachine (hostPort.hostname) && access (call::localPath (hostPort.port) .c_str(), F_OK) == 0) {
+		io::IOStream stream = connectLocal (call::localPath (hostPort.port), true);
+		if (stream) return stream;
+		// stale socket of a server gone, or not ours: fall back to tcp
+	}
+	boost::shared_ptr<boost::asio::ip::tcp::iostream> stream (new boost::asio::ip::tcp::iostream (hostPort.hostname, to_string (hostPort.port)));
+	if (! *stream) throw std::runtime_error ("Cannot connect to " + hostPort.hostname + ":" + to_string (hostPort.port) + ": " + stream->error().message());
+	stream->rdbuf()->set_option (boost::asio::ip::tcp::no_delay (true)); // requests are flushed whole, don't hold them back waiting for acks
+	return stream;
+}
+
+template <class S> static bool expire (std::iostream *stream, long long micros) {
+	S *s = dynamic_cast<S*> (stream);
+	if (!s) return false;
+	if (micros == 0) s->expires_at (S::time_point::max());
+	else s->expires_after (boost::asio::chrono::microseconds (micros));
+	return true;
+}
+
+void call::expiresIn (io::IOStream stream, long long micros) {
+	if (!expire <boost::asio::ip::tcp::iostream> (stream.get(), micros))
+		expire <boost::asio::local::stream_protocol::iostream> (stream.get(), micros);
+}
+
+/** Raise exception server sent, as a Timeout if it is one */
+static void raise (const call::Exception &e) {
+	if (call::isTimeout (e)) throw call::Timeout (e.errorMessage);
+	throw e;
+}
+
+/** Send request in text protocol and wait for response */
+static call::Response callText (io::IOStream stream, call::Request request) {
 	*stream << request;
-	Either <Exception, Response> reply;
+	Either <call::Exception, call::Response> reply;
 	*stream >> reply;
-	boost::optional<Response> r = reply.mRight();
-	if (!r) except::raise (*reply.mLeft());
+	boost::optional<call::Response> r = reply.mRight();
+	if (!r) raise (*reply.mLeft());
 	return *r;
 }
+
+/** Send request in a frame and wait for response frame */
+static call::Response callFramed (io::IOStream stream, call::Request request, executor::Priority priority) {
+	boost::uint8_t flags = priority == executor::Bulk ? frame::Bulk : 0;
+	if (call::compressed (stream) && compression::pack (request.data)) flags |= frame::Compressed;
+	frame::write (*stream, frame::Request, flags, 0, request.data);
+	stream->flush();
+	frame::Header header;
+	call::Response response;
+	if (! frame::read (*stream, header, response.data)) throw std::runtime_error ("Connection closed by server");
+	if (header.flags & frame::Compressed) compression::unpack (response.data);
+	if (header.type == frame::Error) raise (frame::decodeError (response.data));
+	if (header.type != frame::Response) throw std::runtime_error ("Unexpected frame type " + to_string ((unsigned) header.type));
+	return response;
+}
+
+/** Protocol negotiated for a connection */
+struct Protocol {
+	bool frames;
+	bool compress;  // large frame bodies
+	bool handles;  // server decodes function handles
+	Protocol (bool frames, bool compress, bool handles) : frames(frames), compress(compress), handles(handles) {}
+};
+
+/** Protocol negotiated for each open connection. Entries of closed connections are pruned as new ones are added */
+static boost::mutex protocolsMutex;
+static std::map < boost::weak_ptr<std::iostream>, Protocol > protocols;
+
+/** Protocol of connection, asking server to switch to frames the first time we see the connection */
+static Protocol protocol (io::IOStream stream) {
+	if (!call::useFrames) return Protocol (false, false, false);
+	boost::weak_ptr<std::iostream> key (stream);
+	{
+		boost::lock_guard<boost::mutex> lock (protocolsMutex);
+		std::map < boost::weak_ptr<std::iostream>, Protocol >::iterator it = protocols.find (key);
+		if (it != protocols.end()) return it->second;
+	}
+	bool compress, handles;
+	bool frames = frame::negotiate (stream, compress, handles);
+	boost::lock_guard<boost::mutex> lock (protocolsMutex);
+	for (std::map < boost::weak_ptr<std::iostream>, Protocol >::iterator it = protocols.begin(); it != protocols.end();)
+		if (it->first.expired()) protocols.erase (it++);
+		else ++it;
+	protocols.insert (std::make_pair (key, Protocol (frames, compress, handles)));
+	return Protocol (frames, compress, handles);
+}
+
+bool call::servesHandles = false;
+
+/** Whether each server granted handles on the last connection opened to it, guarded by protocolsMutex */
+static std::map < network::HostPort, bool > handlesGranted;
+
+io::IOStream call::connect (network::HostPort hostPort) {
+	io::IOStream stream = connectTo (hostPort);
+	bool handles = protocol (stream) .handles;
+	boost::lock_guard<boost::mutex> lock (protocolsMutex);
+	handlesGranted [hostPort] = handles;
+	return stream;
+}
+
+bool call::acceptsHandles (network::HostPort hostPort) {
+	boost::lock_guard<boost::mutex> lock (protocolsMutex);
+	std::map < network::HostPort, bool >::iterator it = handlesGranted.find (hostPort);
+	return it != handlesGranted.end() && it->second;
+}
+
+bool call::framed (io::IOStream stream) {
+	return protocol (stream) .frames;
+}
+
+bool call::compressed (io::IOStream stream) {
+	return protocol (stream) .compress;
+}
+
+/** Send request over connection and wait for response. Other end of connection must be listening, see above.
+ * Not thread safe */
+call::Response call::call (io::IOStream stream, Request request, executor::Priority priority) {
+	if (framed (stream)) return callFramed (stream, request, priority);
+	return callText (stream, request);
+}
@@ -1,4 +1,4 @@
-/* Simple request-response protocol over a iosteam (tcp connection). Client sends a request over a connection and waits for a response. Server listens for a request on a connection, applies given function to it, and returns its result as response. */
+/* Simple request-response protocol over a iosteam (tcp connection, or Unix domain socket to a server on the same machine). Client sends a request over a connection and waits for a response. Server listens for a request on a connection, applies given function to it, and returns its result as response. */
 
 #pragma once
 
@@ -6,30 +6,64 @@
 #include <10util/network.h>
 #include <boost/function.hpp>
 #include <10util/type.h>
+#include "executor.h"
 
 namespace call {
 
 typedef io::Code Request;
 typedef io::Code Response;
 
-/** Accept client connections, forking a thread for each connection that replies to requests with result of given function. Returns listener thread, which you may terminate to stop listening. */
+/** Accept client connections, forking a thread for each connection that replies to requests with result of given function. Framed requests flagged Concurrent run on a pool of `concurrentThreads` shared by all such servers of this process. Returns listener thread, which you may terminate to stop listening. */
 boost::shared_ptr<boost::thread> listen (network::Port, boost::function1 <Response, Request>);
 
+/** Threads running Concurrent and Streamed framed requests of `listen` servers (see frame.h). A connection is not read while it has that many such requests queued or running. Default 64. Set before first listen */
+extern unsigned concurrentThreads;
+
 inline boost::shared_ptr<boost::thread> listen (network::Port port, Response (*respond) (Request)) {
 	boost::function1 <Response, Request> f = respond;
 	return listen (port, f);
 }
 
-/** Send request over connection and wait for response. Other end of connection must be listening as above.
+/** Same as `listen` except on Unix domain socket at path, replacing any socket left there by a previous server (see `claimLocal`) */
+boost::shared_ptr<boost::thread> listenLocal (std::string path, boost::function1 <Response, Request>);
+
+/** Make path ready for a new Unix domain socket listener: remove a socket left there by a server that is gone, and raise if a server still accepts connections there. Creates the directory of `localPath` sockets, private to this user, if path is in it */
+void claimLocal (std::string path);
+
+/** Hostname prefix of a server on a Unix domain socket, as in "unix:/tmp/app.sock". Its port is ignored */
+const std::string LocalPrefix = "unix:";
+
+/** Unix domain socket where a server on this machine listening on given tcp port also listens, if it does (see remote::listen). In $XDG_RUNTIME_DIR/10remote, or /tmp/10remote-<uid>, so each user has their own */
+std::string localPath (network::Port);
+
+/** Connect to servers on this machine through their Unix domain socket at `localPath` rather than tcp loopback when they have one and run as this user. Default true */
+extern bool useLocal;
+
+/** Open a new connection to server, not shared with other threads, switching it to frames if `useFrames` */
+io::IOStream connect (network::HostPort);
+
+/** Ask servers to switch new connections to the binary frame protocol (see frame.h). Connections to servers that do not support it stay in the text protocol. Default true */
+extern bool useFrames;
+
+/** Grant function handles (see intern.h) to clients asking for them when they switch to frames. Set by remote::listen, whose servers decode them. Default false */
+extern bool servesHandles;
+
+/** Whether server granted function handles on the last connection opened to it. False until one was */
+bool acceptsHandles (network::HostPort);
+
+/** Whether connection uses frames, asking server to switch the first time the connection is seen */
+bool framed (io::IOStream);
+
+/** Whether connection compresses large frame bodies (see compression.h), asking server to switch to frames the first time the connection is seen */
+bool compressed (io::IOStream);
+
+/** Send request over connection and wait for response. Other end of connection must be listening as above. Priority is only honored by servers started with `serve` over frames (see reactor.h).
  * Not thread safe */
-Response call (io::IOStream, Request);
+Response call (io::IOStream, Request, executor::Priority = executor::Interactive);
 
-/** Send request over my thread's persistent connection to give server and wait for response. Server must be listening as above.
+/** Send request over a connection from this process's pool of connections to given server (see pool.h) and wait for response. Server must be listening as above.
  * Thread safe */
-inline Response call (network::HostPort hostPort, Request request) {
-	io::IOStream stream = network::connection (hostPort);
-	return call (stream, request);
-}
+Response call (network::HostPort, Request, executor::Priority = executor::Interactive);
 
 class Exception : public std::exception {
 	friend std::ostream& operator<< (std::ostream& out, const call::Exception &x) {
@@ -45,17 +79,50 @@ class Exception : public std::exception {
 		x.errorMessage = code.data;
 		return in;
 	}
+	mutable std::string whatMessage;  // kept for what()
 public:
 	std::string errorType;  // typically type name
 	std::string errorMessage;
+	/** Exception e raised, or a copy of e if it is one already (eg. raised by another server) */
 	Exception (const std::exception &e)
-		: errorType (typeName(e)), errorMessage (std::string (e.what())) {}
+		: errorType (typeName(e)), errorMessage (std::string (e.what())) {
+		const Exception *x = dynamic_cast<const Exception*> (&e);
+		if (x) {
+			errorType = x->errorType;
+			errorMessage = x->errorMessage;
+		}
+	}
 	Exception (std::string message) : errorType (typeName<Exception>()), errorMessage(message) {}
 	Exception () {}  // for serialization
 	~Exception () throw () {}
 	const char* what() const throw () {  // overriden
-		return ("(" + errorType + ") " + errorMessage) .c_str();
+		whatMessage = "(" + errorType + ") " + errorMessage;
+		return whatMessage.c_str();
 	}
 };
 
+/** Raised by a call whose deadline passed (see deadline.h), by the server if it gave up on the call or by the client if no response came in time */
+class Timeout : public Exception {
+public:
+	Timeout (std::string message) : Exception (message) {errorType = typeName<Timeout>();}
+	~Timeout () throw () {}
+};
+
+/** Whether exception raised by server is a Timeout */
+inline bool isTimeout (const Exception &e) {return e.errorType == typeName<Timeout>();}
+
+/** Make blocking reads and writes on connection fail after micros, or never again if 0. A connection that expired is closed */
+void expiresIn (io::IOStream, long long micros);
+
+}
+
+/* Serialization */
+
+namespace boost {namespace serialization {
+
+template <class Archive> void serialize (Archive & ar, call::Exception & x, const unsigned version) {
+	ar & x.errorType;
+	ar & x.errorMessage;
 }
+
+}}
@@ -0,0 +1,159 @@
+#include "channel.h"
+#include "compression.h"
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+call::Channel::Channel (io::IOStream stream, bool framed, bool compress) : stream(stream), framed(framed), compress(compress), nextId(1) {}
+
+boost::shared_ptr<call::Channel> call::Channel::open (network::HostPort hostPort) {
+	io::IOStream stream = connect (hostPort);
+	boost::shared_ptr<Channel> channel (new Channel (stream, call::framed (stream), call::compressed (stream)));
+	if (channel->framed) boost::thread _th (boost::bind (&Channel::readLoop, channel));
+	return channel;
+}
+
+bool call::Channel::isOpen () {
+	boost::lock_guard<boost::mutex> lock (pendingMutex);
+	return closed.empty();
+}
+
+/** Fail all outstanding requests and end their streams */
+void call::Channel::close (std::string reason) {
+	std::map < boost::uint32_t, future::Promise<Response> > failed;
+	std::map < boost::uint32_t, boost::shared_ptr<streaming::Queue> > ended;
+	{
+		boost::lock_guard<boost::mutex> lock (pendingMutex);
+		if (closed.empty()) closed = reason;
+		failed.swap (pending);
+		ended.swap (streams);
+	}
+	for (std::map < boost::uint32_t, future::Promise<Response> >::iterator it = failed.begin(); it != failed.end(); ++it)
+		it->second.setError (boost::copy_exception (std::runtime_error ("Channel closed: " + reason)));
+	for (std::map < boost::uint32_t, boost::shared_ptr<streaming::Queue> >::iterator it = ended.begin(); it != ended.end(); ++it)
+		it->second->end();
+}
+
+/** Deliver each response to the request with its id, and each chunk to the stream with its id */
+void call::Channel::readLoop () {
+	try {
+		frame::Header header;
+		Response response;
+		while (frame::read (*stream, header, response.data)) {
+			if (header.type == frame::Chunk) {
+				boost::shared_ptr<streaming::Queue> queue;
+				{
+					boost::lock_guard<boost::mutex> lock (pendingMutex);
+					std::map < boost::uint32_t, boost::shared_ptr<streaming::Queue> >::iterator it = streams.find (header.id);
+					if (it == streams.end()) continue; // nobody reading any more
+					queue = it->second;
+				}
+				if (header.flags & frame::Compressed) compression::unpack (response.data); // corrupt chunk, give up on channel
+				queue->push (response.data);
+				continue;
+			}
+			future::Promise<Response> promise;
+			boost::shared_ptr<streaming::Queue> queue;
+			{
+				boost::lock_guard<boost::mutex> lock (pendingMutex);
+				std::map < boost::uint32_t, future::Promise<Response> >::iterator it = pending.find (header.id);
+				if (it == pending.end()) continue; // nobody waiting any more
+				promise = it->second;
+				pending.erase (it);
+				std::map < boost::uint32_t, boost::shared_ptr<streaming::Queue> >::iterator s = streams.find (header.id);
+				if (s != streams.end()) {
+					queue = s->second;
+					streams.erase (s);
+				}
+			}
+			if (header.flags & frame::Compressed) {
+				try {compression::unpack (response.data);}
+				catch (std::exception &e) {
+					promise.setError (e);
+					if (queue) queue->end();
+					continue;
+				}
+			}
+			if (header.type == frame::Error) {
+				call::Exception e = frame::decodeError (response.data);
+				if (call::isTimeout (e)) promise.setError (boost::copy_exception (call::Timeout (e.errorMessage)));
+				else promise.setError (boost::copy_exception (e));
+			}
+			else promise.setValue (response);
+			if (queue) queue->end(); // after promise, so stream reader sees how it ended
+		}
+		close ("closed by server");
+	} catch (std::exception &e) {
+		close (e.what());
+	}
+}
+
+future::Future<call::Response> call::Channel::send (Request request, executor::Priority priority) {
+	return sendFrame (request, priority, boost::shared_ptr<streaming::Queue>());
+}
+
+future::Future<call::Response> call::Channel::sendStreamed (Request request, boost::shared_ptr<streaming::Queue> queue, executor::Priority priority) {
+	if (!framed) throw std::runtime_error ("Streamed call needs a server speaking frames");
+	return sendFrame (request, priority, queue);
+}
+
+/** Send request in a frame, or unframed if server only speaks text. Request is Streamed to queue unless queue is null */
+future::Future<call::Response> call::Channel::sendFrame (Request request, executor::Priority priority, boost::shared_ptr<streaming::Queue> queue) {
+	future::Promise<Response> promise;
+	if (!framed) { // one request at a time
+		boost::lock_guard<boost::mutex> lock (writeMutex);
+		try {promise.setValue (call::call (stream, request, priority));}
+		catch (call::Timeout &e) {promise.setError (boost::copy_exception (e));}
+		catch (call::Exception &e) {promise.setError (boost::copy_exception (e));}
+		catch (std::exception &e) {
+			promise.setError (e);
+			close (e.what());
+		}
+		return promise.future();
+	}
+	boost::uint32_t id;
+	{
+		boost::lock_guard<boost::mutex> lock (pendingMutex);
+		if (!closed.empty()) throw std::runtime_error ("Channel closed: " + closed);
+		id = nextId++;
+		if (nextId == 0) nextId = 1; // 0 is for unmultiplexed calls
+		pending [id] = promise;
+		if (queue) streams [id] = queue;
+	}
+	if (queue) queue->granting (boost::bind (&Channel::credit, shared_from_this(), id, _1));
+	boost::uint8_t flags = frame::Concurrent | (priority == executor::Bulk ? frame::Bulk : 0) | (queue ? frame::Streamed : 0);
+	if (compress && compression::pack (request.data)) flags |= frame::Compressed;
+	try {
+		boost::lock_guard<boost::mutex> lock (writeMutex);
+		frame::write (*stream, frame::Request, flags, id, request.data);
+		stream->flush();
+		if (! *stream) throw std::runtime_error ("write failed");
+	} catch (std::exception &e) {
+		close (e.what());
+	}
+	return promise.future();
+}
+
+void call::Channel::credit (boost::uint32_t id, unsigned n) {
+	boost::lock_guard<boost::mutex> lock (writeMutex);
+	frame::write (*stream, frame::Credit, 0, id, frame::encodeCredit (n));
+	stream->flush();
+	if (! *stream) throw std::runtime_error ("write failed");
+}
+
+static boost::mutex channelsMutex;
+static std::map < network::HostPort, boost::shared_ptr<call::Channel> > channels;
+
+static boost::shared_ptr<call::Channel> channel (network::HostPort hostPort) {
+	boost::lock_guard<boost::mutex> lock (channelsMutex);
+	boost::shared_ptr<call::Channel> &c = channels [hostPort];
+	if (!c || !c->isOpen()) c = call::Channel::open (hostPort);
+	return c;
+}
+
+future::Future<call::Response> call::send (network::HostPort hostPort, Request request, executor::Priority priority) {
+	return channel (hostPort) ->send (request, priority);
+}
+
+future::Future<call::Response> call::sendStreamed (network::HostPort hostPort, Request request, boost::shared_ptr<streaming::Queue> queue, executor::Priority priority) {
+	return channel (hostPort) ->sendStreamed (request, queue, priority);
+}
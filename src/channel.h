@@ -0,0 +1,46 @@
+/* Multiplexed connection to a server. Many threads may have requests outstanding on one channel at once; the server runs them concurrently and answers in any order, each response matched to its request by id. One reader thread per channel receives all responses. */
+
+#pragma once
+
+#include <map>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+#include "frame.h"
+#include "future.h"
+#include "streaming.h"
+
+namespace call {
+
+class Channel : public boost::enable_shared_from_this<Channel> {
+	io::IOStream stream;
+	bool framed;  // false if server only speaks the text protocol, in which case requests are sent one at a time
+	bool compress;  // large frame bodies, see compression.h
+	boost::mutex writeMutex;
+	boost::mutex pendingMutex;  // guards below
+	std::map < boost::uint32_t, future::Promise<Response> > pending;
+	std::map < boost::uint32_t, boost::shared_ptr<streaming::Queue> > streams;  // of pending Streamed requests
+	boost::uint32_t nextId;
+	std::string closed;  // reason channel closed, empty while open
+	void readLoop ();
+	void close (std::string reason);
+	Channel (io::IOStream stream, bool framed, bool compress);
+	future::Future<Response> sendFrame (Request, executor::Priority, boost::shared_ptr<streaming::Queue> queue);
+public:
+	/** Connect to server and start reader thread */
+	static boost::shared_ptr<Channel> open (network::HostPort);
+	/** Send request and return immediately. Future holds response, or call::Exception raised by server, or error if channel closed first. Thread safe */
+	future::Future<Response> send (Request, executor::Priority = executor::Interactive);
+	/** Same as `send` except server sends the result in chunks as it produces it (see streaming.h), which are pushed to queue as they arrive. Future holds final response, and is ready before queue ends. Throw if server does not speak frames */
+	future::Future<Response> sendStreamed (Request, boost::shared_ptr<streaming::Queue>, executor::Priority = executor::Interactive);
+	/** Grant server credit for n more chunks of streamed request */
+	void credit (boost::uint32_t id, unsigned n);
+	bool isOpen ();
+};
+
+/** Send request over this process's shared channel to server, opening a new channel if there is none or it closed. Thread safe */
+future::Future<Response> send (network::HostPort, Request, executor::Priority = executor::Interactive);
+
+/** Same as above for a streamed request, see Channel::sendStreamed */
+future::Future<Response> sendStreamed (network::HostPort, Request, boost::shared_ptr<streaming::Queue>, executor::Priority = executor::Interactive);
+
+}
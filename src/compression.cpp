@@ -0,0 +1,71 @@
+#include "compression.h"
+#include "frame.h"
+#include <ctime>
+#include <stdexcept>
+#include <zlib.h>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+bool compression::enabled = true;
+
+unsigned compression::threshold = 8192;
+
+static boost::mutex statsMutex;  // 64-bit counters, so not atomic_count
+static compression::Stats counters;
+
+/** CPU microseconds used by calling thread */
+static long long cpuTime () {
+	struct timespec t;
+	clock_gettime (CLOCK_THREAD_CPUTIME_ID, &t);
+	return (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+compression::Stats compression::stats () {
+	boost::lock_guard<boost::mutex> lock (statsMutex);
+	return counters;
+}
+
+/** Packed body is original length (4 bytes, big-endian) then zlib stream */
+bool compression::pack (std::string &body) {
+	if (body.size() < threshold) return false;
+	long long start = cpuTime();
+	uLongf length = compressBound (body.size());
+	std::string packed (4 + length, '\0');
+	boost::uint32_t n = body.size();
+	packed[0] = (char) (n >> 24); packed[1] = (char) (n >> 16); packed[2] = (char) (n >> 8); packed[3] = (char) n;
+	bool ok = ::compress2 ((Bytef*) &packed[4], &length, (const Bytef*) body.data(), body.size(), Z_BEST_SPEED) == Z_OK
+		&& 4 + length < body.size();
+	long long time = cpuTime() - start;
+	boost::lock_guard<boost::mutex> lock (statsMutex);
+	counters.compressTime += time;
+	if (!ok) {
+		counters.skipped++;
+		return false;
+	}
+	packed.resize (4 + length);
+	counters.compressed++;
+	counters.bytesIn += body.size();
+	counters.bytesOut += packed.size();
+	body.swap (packed);
+	return true;
+}
+
+/** Most bytes deflate expands one compressed byte into */
+static const uLongf MaxRatio = 1032;
+
+void compression::unpack (std::string &body) {
+	long long start = cpuTime();
+	if (body.size() < 4) throw std::runtime_error ("Corrupt compressed body");
+	const unsigned char* u = (const unsigned char*) body.data();
+	uLongf length = ((boost::uint32_t) u[0] << 24) | ((boost::uint32_t) u[1] << 16) | ((boost::uint32_t) u[2] << 8) | u[3];
+	if (length > frame::maxLength || length > (body.size() - 4) * MaxRatio) throw std::runtime_error ("Corrupt compressed body"); // before allocating what the prefix claims
+	std::string data (length, '\0');
+	if (length > 0 && uncompress ((Bytef*) &data[0], &length, (const Bytef*) body.data() + 4, body.size() - 4) != Z_OK)
+		throw std::runtime_error ("Corrupt compressed body");
+	if (length != data.size()) throw std::runtime_error ("Corrupt compressed body");
+	body.swap (data);
+	long long time = cpuTime() - start;
+	boost::lock_guard<boost::mutex> lock (statsMutex);
+	counters.decompressTime += time;
+}
@@ -0,0 +1,37 @@
+/* Compression of large frame bodies (see frame.h). A client offers compression when it switches a connection to frames, and if the server accepts, either end may compress any body at least `threshold` bytes long and flag its frame Compressed. Bodies that do not shrink are sent as is, so small and incompressible calls cost nothing but a size check.
+ * Bodies are compressed with zlib at its fastest level, prefixed by their original length. */
+
+#pragma once
+
+#include <string>
+
+namespace compression {
+
+	/** Offer and accept compression on new connections. Default true */
+	extern bool enabled;
+
+	/** Smallest body worth compressing, in bytes. Default 8KB */
+	extern unsigned threshold;
+
+	/** Snapshot of counters of this process */
+	struct Stats {
+		long compressed;  // bodies sent compressed
+		long skipped;  // bodies at least threshold long that did not shrink, sent as is
+		long long bytesIn;  // of compressed bodies before compression
+		long long bytesOut;  // of compressed bodies after compression
+		long long compressTime;  // CPU microseconds spent compressing
+		long long decompressTime;  // CPU microseconds spent decompressing
+		Stats () : compressed(0), skipped(0), bytesIn(0), bytesOut(0), compressTime(0), decompressTime(0) {}
+		/** bytesIn / bytesOut, or 1 if nothing compressed */
+		double ratio () const {return bytesOut == 0 ? 1 : (double) bytesIn / bytesOut;}
+	};
+
+	Stats stats ();
+
+	/** Compress body in place if it is large enough and shrinks. Return true if compressed */
+	bool pack (std::string &body);
+
+	/** Decompress body packed by `pack`. Throw if corrupt */
+	void unpack (std::string &body);
+
+}
@@ -0,0 +1,323 @@
+#include "deadline.h"
+#include "call.h"
+#include "streaming.h"
+#include "executor.h"
+#include <set>
+#include <map>
+#include <deque>
+#include <sstream>
+#include <time.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <10util/util.h> // to_string
+
+unsigned deadline::slack = 1000;
+
+static long long now () {
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/** Monotonic microseconds of this thread's deadline, 0 if none */
+static boost::thread_specific_ptr<long long> current;
+
+static long long get () {return current.get() ? *current : 0;}
+
+static void set (long long t) {
+	if (!current.get()) current.reset (new long long);
+	*current = t;
+}
+
+/* Client */
+
+deadline::Scope::Scope (boost::posix_time::time_duration timeout) : saved (get()) {
+	long long t = now() + timeout.total_microseconds();
+	set (saved != 0 && saved < t ? saved : t);
+}
+
+deadline::Scope::~Scope () {set (saved);}
+
+bool deadline::active () {return get() != 0;}
+
+long long deadline::remaining () {return get() - now();}
+
+/** Cancel token of this thread's calls, 0 if none */
+static boost::thread_specific_ptr<boost::uint64_t> token;
+
+static boost::uint64_t getToken () {return token.get() ? *token : 0;}
+
+static void setToken (boost::uint64_t t) {
+	if (!token.get()) token.reset (new boost::uint64_t);
+	*token = t;
+}
+
+deadline::Cancellable::Cancellable (boost::uint64_t t) : saved (getToken()) {setToken (t);}
+
+deadline::Cancellable::~Cancellable () {setToken (saved);}
+
+deadline::Context deadline::current () {
+	Context c;
+	c.expires = get();
+	c.token = getToken();
+	return c;
+}
+
+deadline::Adopt::Adopt (Context c) : saved (current()) {
+	set (c.expires);
+	setToken (c.token);
+}
+
+deadline::Adopt::~Adopt () {
+	set (saved.expires);
+	setToken (saved.token);
+}
+
+/** Request with deadline is '~' microseconds left (0 if none) ['.' hex token] '\n' request. Time left rather than the deadline itself, so client and server clocks need not agree */
+io::Code deadline::request (const io::Code &request) {
+	boost::uint64_t t = getToken();
+	if (!active() && t == 0) return request;
+	long long left = 0;
+	if (active()) {
+		left = remaining();
+		if (left <= 0) throw call::Timeout ("Deadline passed before call was sent");
+	}
+	std::ostringstream out;
+	out << '~' << left;
+	if (t != 0) out << '.' << std::hex << t;
+	out << '\n';
+	return io::Code (out.str() + request.data);
+}
+
+static const std::string CancelPrefix = "?cancel ";
+
+io::Code deadline::cancelRequest (boost::uint64_t t) {
+	std::ostringstream out;
+	out << CancelPrefix << std::hex << t;
+	return io::Code (out.str());
+}
+
+/* Server */
+
+bool deadline::has (const io::Code &request) {
+	return !request.data.empty() && request.data[0] == '~';
+}
+
+static boost::thread_specific_ptr<long long> queuedFor;
+
+void deadline::queued (long long micros) {
+	if (!queuedFor.get()) queuedFor.reset (new long long);
+	*queuedFor = micros;
+}
+
+/** Call whose thread is interrupted once it passes its deadline or is cancelled. Registered while alive */
+struct Watch {
+	boost::thread *thread;
+	long long expires;  // monotonic microseconds, 0 if none
+	boost::uint64_t token;  // 0 if none
+	bool fired;  // thread was interrupted, guarded by watchMutex
+	bool byCancel;  // interrupted by cancel request rather than deadline
+	Watch (boost::thread *thread, long long expires, boost::uint64_t token);
+	~Watch ();
+	bool interrupted () const;
+};
+
+static boost::mutex watchMutex;  // guards below and Watch::fired
+static boost::condition_variable watchChanged;
+static std::multimap < long long, Watch* > byExpiry;  // watches with a deadline
+static std::map < boost::uint64_t, Watch* > running;  // watches by token
+static std::set<boost::uint64_t> cancelled;  // tokens cancelled before their call ran
+static std::deque<boost::uint64_t> cancelOrder;  // of cancelled, oldest first
+static const unsigned MaxCancelled = 4096;
+static bool watching = false;  // watchdog started
+
+static void fire (Watch *w, bool cancel) {
+	if (w->fired) return;
+	w->fired = true;
+	w->byCancel = cancel;
+	w->thread->interrupt();
+}
+
+/** Interrupt calls as their deadlines pass */
+static void watchdog () {
+	boost::unique_lock<boost::mutex> lock (watchMutex);
+	for (;;) {
+		if (byExpiry.empty()) {
+			watchChanged.wait (lock);
+			continue;
+		}
+		long long wait = byExpiry.begin()->first - now();
+		if (wait > 0) {
+			watchChanged.timed_wait (lock, boost::posix_time::microseconds (wait));
+			continue;
+		}
+		fire (byExpiry.begin()->second, false);
+		byExpiry.erase (byExpiry.begin());
+	}
+}
+
+Watch::Watch (boost::thread *thread, long long expires, boost::uint64_t token) : thread(thread), expires(expires), token(token), fired(false), byCancel(false) {
+	boost::lock_guard<boost::mutex> lock (watchMutex);
+	if (expires != 0) {
+		if (!watching) {
+			boost::thread (watchdog) .detach();
+			watching = true;
+		}
+		std::multimap < long long, Watch* >::iterator it = byExpiry.insert (std::make_pair (expires, this));
+		if (it == byExpiry.begin()) watchChanged.notify_one();
+	}
+	if (token != 0) {
+		if (cancelled.count (token)) fire (this, true);
+		else running [token] = this;
+	}
+}
+
+Watch::~Watch () {
+	bool late;
+	{
+		boost::lock_guard<boost::mutex> lock (watchMutex);
+		if (expires != 0) {
+			std::pair < std::multimap < long long, Watch* >::iterator, std::multimap < long long, Watch* >::iterator > r = byExpiry.equal_range (expires);
+			for (std::multimap < long long, Watch* >::iterator it = r.first; it != r.second; ++it)
+				if (it->second == this) {
+					byExpiry.erase (it);
+					break;
+				}
+		}
+		if (token != 0) {
+			std::map < boost::uint64_t, Watch* >::iterator it = running.find (token);
+			if (it != running.end() && it->second == this) running.erase (it);
+		}
+		late = fired && thread == executor::currentThread();
+	}
+	// an interruption the call did not reach would otherwise hit the worker's next task
+	if (late) try {boost::this_thread::interruption_point();} catch (boost::thread_interrupted&) {}
+}
+
+bool Watch::interrupted () const {
+	boost::lock_guard<boost::mutex> lock (watchMutex);
+	return fired;
+}
+
+static bool wasCancelled (boost::uint64_t t) {
+	boost::lock_guard<boost::mutex> lock (watchMutex);
+	return cancelled.count (t) > 0;
+}
+
+bool deadline::isCancel (const io::Code &request) {
+	return request.data.compare (0, CancelPrefix.size(), CancelPrefix) == 0;
+}
+
+/** Interrupt call running with token, or remember token so its call is skipped when it comes */
+io::Code deadline::reply (const io::Code &request) {
+	std::istringstream in (request.data.substr (CancelPrefix.size()));
+	boost::uint64_t t = 0;
+	in >> std::hex >> t;
+	if (!in) throw std::runtime_error ("Corrupt cancel request");
+	boost::lock_guard<boost::mutex> lock (watchMutex);
+	std::map < boost::uint64_t, Watch* >::iterator it = running.find (t);
+	if (it != running.end()) fire (it->second, true);
+	else if (cancelled.insert (t) .second) {
+		cancelOrder.push_back (t);
+		if (cancelOrder.size() > MaxCancelled) {
+			cancelled.erase (cancelOrder.front());
+			cancelOrder.pop_front();
+		}
+	}
+	return io::Code();
+}
+
+static io::Code respondWithin (boost::function1 <io::Code, io::Code> respond, const io::Code &request, long long left) {
+	if (left == 0) return respond (request);
+	deadline::Scope scope ((boost::posix_time::microseconds (left)));
+	return respond (request);
+}
+
+/** Threads running calls that passed their deadline off a worker thread, left to end on their own */
+static boost::detail::atomic_count orphanCount (0);
+static const long MaxOrphans = 64;
+
+long deadline::orphans () {return orphanCount;}
+
+/** Response or exception of a call run on a thread of its own */
+struct Served {
+	boost::mutex mutex;  // guards done and orphaned
+	bool done;
+	bool orphaned;  // counted in orphanCount
+	io::Code response;
+	bool failed;
+	bool interrupted;
+	call::Exception error;
+	Served () : done(false), orphaned(false), failed(false), interrupted(false) {}
+};
+
+static void runServed (boost::function1 <io::Code, io::Code> respond, io::Code request, long long left, boost::shared_ptr<Served> served) {
+	try {served->response = respondWithin (respond, request, left);}
+	catch (boost::thread_interrupted&) { // timed out or cancelled
+		served->interrupted = true;
+	} catch (std::exception &e) {
+		served->failed = true;
+		served->error = call::Exception (e);
+	}
+	boost::lock_guard<boost::mutex> lock (served->mutex);
+	served->done = true;
+	if (served->orphaned) --orphanCount;
+}
+
+/** Run call on a thread of its own, for servers whose threads are not executor workers */
+static io::Code serveOnThread (boost::function1 <io::Code, io::Code> respond, const io::Code &request, long long left, boost::uint64_t token) {
+	boost::shared_ptr<Served> served (new Served);
+	boost::thread t (boost::bind (runServed, respond, request, left, served));
+	bool finished = true;
+	{
+		Watch watch (&t, 0, token); // for cancellation, deadline is awaited below
+		if (left == 0) t.join();
+		else finished = t.timed_join (boost::posix_time::microseconds (left));
+	}
+	if (!finished) {
+		{
+			boost::lock_guard<boost::mutex> lock (served->mutex);
+			if (!served->done) {
+				served->orphaned = true;
+				++orphanCount;
+			}
+		}
+		t.interrupt(); // thread ends at its next interruption point
+		t.detach();
+		throw call::Timeout ("Deadline of " + to_string (left) + "us passed");
+	}
+	if (served->interrupted) throw call::Exception ("Call cancelled");
+	if (served->failed) throw served->error;
+	return served->response;
+}
+
+io::Code deadline::serve (io::Code request, boost::function1 <io::Code, io::Code> respond) {
+	size_t end = request.data.find ('\n');
+	std::istringstream in (request.data.substr (1, end == std::string::npos ? 0 : end - 1));
+	long long left = 0;
+	boost::uint64_t token = 0;
+	in >> left;
+	if (in && !in.eof() && in.peek() == '.') in.ignore (1) >> std::hex >> token;
+	if (end == std::string::npos || !in) throw std::runtime_error ("Corrupt deadline");
+	request.data.erase (0, end + 1);
+	long long waited = 0;
+	if (queuedFor.get()) {
+		waited = *queuedFor;
+		*queuedFor = 0;
+	}
+	if (token != 0 && wasCancelled (token)) throw call::Exception ("Call cancelled while queued");
+	if (left != 0 && (left -= waited) <= 0) throw call::Timeout ("Deadline passed while call was queued");
+	boost::thread *self = executor::currentThread();
+	if (!self) {
+		if (streaming::active() || orphanCount >= MaxOrphans) return respondWithin (respond, request, left); // chunks are written from this thread, or too many threads left running: no interruption
+		return serveOnThread (respond, request, left, token);
+	}
+	Watch watch (self, left == 0 ? 0 : now() + left, token);
+	try {return respondWithin (respond, request, left);}
+	catch (boost::thread_interrupted&) {
+		if (!watch.interrupted()) throw; // not ours, eg. server stopping
+		if (watch.byCancel) throw call::Exception ("Call cancelled");
+		throw call::Timeout ("Deadline of " + to_string (left) + "us passed");
+	}
+}
@@ -0,0 +1,92 @@
+/* Deadlines and cancellation of calls. A thread sets one with a `Scope`, and every remote call it makes while in scope carries the time left in its request. A server gives up on a call once that time passes: it skips the call if it is still queued, or interrupts the thread running it (see boost thread interruption) and answers call::Timeout, so the connection is left clean for the next call. Calls the function itself makes run under what is left of its deadline.
+ * A client waits `slack` past the deadline for the server's answer, in case the server is hung or unreachable, then drops the connection and raises call::Timeout itself.
+ * Calls sent under a `Cancellable` token, with or without a deadline, are run the same way, and `cancelRequest` makes a server interrupt the one it is running with that token, or skip it if it is still queued. */
+
+#pragma once
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <10util/io.h>
+
+namespace deadline {
+
+	/** Milliseconds a client waits past a deadline for the server to answer Timeout before giving up on the connection. Default 1000 */
+	extern unsigned slack;
+
+	/* Client */
+
+	/** Calls made by this thread while in scope must finish within timeout, or sooner if already under a deadline */
+	class Scope {
+		long long saved;  // deadline before scope
+		Scope (const Scope&);  // not copyable
+		void operator= (const Scope&);
+	public:
+		Scope (boost::posix_time::time_duration timeout);
+		~Scope ();
+	};
+
+	/** Whether this thread is under a deadline */
+	bool active ();
+
+	/** Microseconds left until this thread's deadline, 0 or less once passed */
+	long long remaining ();
+
+	/** Calls made by this thread while in scope carry token, so they can be cancelled */
+	class Cancellable {
+		boost::uint64_t saved;  // token before scope
+		Cancellable (const Cancellable&);  // not copyable
+		void operator= (const Cancellable&);
+	public:
+		Cancellable (boost::uint64_t token);
+		~Cancellable ();
+	};
+
+	/** Deadline and cancel token of a thread, to carry to threads it starts */
+	struct Context {
+		long long expires;  // monotonic microseconds, 0 if none
+		boost::uint64_t token;  // 0 if none
+		Context () : expires(0), token(0) {}
+	};
+
+	/** Deadline and cancel token of this thread */
+	Context current ();
+
+	/** Calls made by this thread while in scope run under context, as if made by the thread it was taken from */
+	class Adopt {
+		Context saved;  // of this thread before scope
+		Adopt (const Adopt&);  // not copyable
+		void operator= (const Adopt&);
+	public:
+		Adopt (Context);
+		~Adopt ();
+	};
+
+	/** Request prefixed with time left until this thread's deadline and its cancel token, if any. Raise call::Timeout if deadline passed already */
+	io::Code request (const io::Code &request);
+
+	/** Request cancelling the call a server runs with token. Response is empty, whether or not there was such a call */
+	io::Code cancelRequest (boost::uint64_t token);
+
+	/* Server */
+
+	/** Whether request carries a deadline or cancel token */
+	bool has (const io::Code &request);
+
+	/** Respond to request carrying a deadline or token under what is left of the deadline. Raise call::Timeout, interrupting the call, if it does not finish in time, or without starting it if the deadline passed while the request was queued. Raise call::Exception if cancelled.
+	 * On an executor worker the call runs right there and a watchdog thread interrupts it. On other threads it runs on a thread of its own, left to end by itself after its deadline (see `orphans`) */
+	io::Code serve (io::Code request, boost::function1 <io::Code, io::Code> respond);
+
+	/** Threads of calls that passed their deadline off an executor worker and have not ended yet. Beyond 64, such calls run without interruption */
+	long orphans ();
+
+	/** Whether request cancels a call (see `cancelRequest`) */
+	bool isCancel (const io::Code &request);
+
+	/** Cancel call. Empty response */
+	io::Code reply (const io::Code &request);
+
+	/** Set time the request about to be served on this thread waited for a worker */
+	void queued (long long micros);
+
+}
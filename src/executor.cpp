@@ -0,0 +1,92 @@
+#include "executor.h"
+#include <algorithm>
+#include <iostream>
+#include <boost/bind.hpp>
+
+executor::Executor::Executor (unsigned size, unsigned interactiveOnly)
+	: interactiveOnly (size > 1 ? std::min (interactiveOnly, size - 1) : 0), // at least one worker runs bulk tasks
+	next(0), queued0(0), queued1(0), executed0(0), executed1(0), steals(0) {
+	for (unsigned w = 0; w < std::max (size, 1u); w++) workers.push_back (boost::shared_ptr<Worker> (new Worker));
+	for (unsigned w = 0; w < workers.size(); w++) {
+		boost::lock_guard<boost::mutex> lock (workers[w]->mutex);
+		workers[w]->thread = threads.create_thread (boost::bind (&Executor::work, this, w));
+	}
+}
+
+static void keep (boost::thread*) {} // owned by its thread group
+static boost::thread_specific_ptr<boost::thread> current (keep);
+
+boost::thread *executor::currentThread () {return current.get();}
+
+executor::Executor::~Executor () {
+	threads.interrupt_all();
+	threads.join_all();
+}
+
+void executor::Executor::submit (boost::function0<void> task, Priority p) {
+	unsigned w = self.get() ? *self : (unsigned) ++next % workers.size();
+	++queued (p); // before queueing so the count never goes negative
+	{
+		boost::lock_guard<boost::mutex> lock (workers[w]->mutex);
+		workers[w]->queues[p].push_back (task);
+	}
+	boost::lock_guard<boost::mutex> lock (idleMutex);
+	if (p == Bulk) idle.notify_all(); // the woken worker must be one that runs bulk tasks
+	else idle.notify_one();
+}
+
+/** Take task of priority from worker w's own queue (oldest first), or else steal from another worker (newest first) */
+bool executor::Executor::take (unsigned w, Priority p, boost::function0<void> &task) {
+	for (unsigned i = 0; i < workers.size(); i++) {
+		unsigned v = (w + i) % workers.size();
+		boost::lock_guard<boost::mutex> lock (workers[v]->mutex);
+		std::deque< boost::function0<void> > &q = workers[v]->queues[p];
+		if (q.empty()) continue;
+		if (i == 0) {
+			task = q.front();
+			q.pop_front();
+		} else {
+			task = q.back();
+			q.pop_back();
+			++steals;
+		}
+		--queued (p);
+		return true;
+	}
+	return false;
+}
+
+void executor::Executor::work (unsigned w) {
+	self.reset (new unsigned (w));
+	{
+		boost::lock_guard<boost::mutex> lock (workers[w]->mutex);
+		current.reset (workers[w]->thread);
+	}
+	bool bulk = w >= interactiveOnly;
+	for (;;) {
+		boost::function0<void> task;
+		Priority p = Interactive;
+		if (!take (w, Interactive, task)) {
+			p = Bulk;
+			if (!bulk || !take (w, Bulk, task)) {
+				boost::unique_lock<boost::mutex> lock (idleMutex);
+				if (queued0 == 0 && (!bulk || queued1 == 0)) idle.timed_wait (lock, boost::posix_time::milliseconds (100));
+				continue;
+			}
+		}
+		try {task ();}
+		catch (boost::thread_interrupted &) {throw;}
+		catch (std::exception &e) {std::cerr << "executor task failed: " << e.what() << std::endl;}
+		++ (p == Interactive ? executed0 : executed1);
+	}
+}
+
+executor::Stats executor::Executor::stats () const {
+	Stats s;
+	s.queued[Interactive] = queued0;
+	s.queued[Bulk] = queued1;
+	s.executed[Interactive] = executed0;
+	s.executed[Bulk] = executed1;
+	s.steals = steals;
+	return s;
+}
@@ -0,0 +1,63 @@
+/* Work-stealing pool of threads with two priority classes. Each worker has its own queue per class and steals from other workers when its own are empty. Interactive tasks always run before bulk ones, and some workers only ever run interactive tasks, so a short call never waits behind long running bulk work. */
+
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+namespace executor {
+
+enum Priority {
+	Interactive = 0,  // latency sensitive, eg. a getter
+	Bulk = 1  // eg. a multi-second job
+};
+
+/** Snapshot of an executor's counters */
+struct Stats {
+	long queued [2];  // waiting tasks by priority
+	long executed [2];  // tasks run by priority
+	long steals;  // tasks a worker took from another worker's queue
+	Stats () : steals(0) {queued[0] = queued[1] = executed[0] = executed[1] = 0;}
+};
+
+class Executor {
+	struct Worker {
+		boost::mutex mutex;
+		std::deque< boost::function0<void> > queues [2];
+		boost::thread *thread;  // running worker, set under mutex
+		Worker () : thread(0) {}
+	};
+	std::vector< boost::shared_ptr<Worker> > workers;
+	unsigned interactiveOnly;  // workers [0, interactiveOnly) never run bulk tasks
+	boost::thread_group threads;
+	boost::mutex idleMutex;
+	boost::condition_variable idle;
+	boost::detail::atomic_count next;  // round robin for tasks submitted from outside
+	boost::detail::atomic_count queued0, queued1, executed0, executed1, steals;
+	boost::thread_specific_ptr<unsigned> self;  // index of worker running on this thread
+
+	boost::detail::atomic_count& queued (Priority p) {return p == Interactive ? queued0 : queued1;}
+	bool take (unsigned w, Priority p, boost::function0<void> &task);
+	void work (unsigned w);
+	Executor (const Executor&);  // not copyable
+	void operator= (const Executor&);
+public:
+	/** Start `size` workers, `interactiveOnly` of them reserved for interactive tasks */
+	Executor (unsigned size, unsigned interactiveOnly = 1);
+	/** Interrupt and join workers. Tasks still queued are dropped */
+	~Executor ();
+	/** Queue task. From a worker thread it goes on that worker's own queue, otherwise on the next worker's in turn */
+	void submit (boost::function0<void> task, Priority = Interactive);
+	/** Number of tasks waiting */
+	long depth () const {return queued0 + queued1;}
+	Stats stats () const;
+};
+
+/** Thread of the executor worker calling this, so others can interrupt the task it runs. 0 if not called from a worker */
+boost::thread *currentThread ();
+
+}
@@ -0,0 +1,157 @@
+#include "frame.h"
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+#include <10util/either.h>
+#include <10util/util.h> // to_string
+#include "compression.h"
+
+const std::string frame::Hello = "\x01" "10remote-frame/3";
+const std::string frame::HelloAck = "\x01" "10remote-frame/3 ok";
+
+/** Start of Hello of any version */
+static const std::string HelloPrefix = "\x01" "10remote-frame/";
+
+/** Hello and HelloAck of version 2, whose closure args were encoded one by one */
+static const std::string Hello2 = HelloPrefix + "2";
+static const std::string Hello2Ack = Hello2 + " ok";
+boost::uint32_t frame::maxLength = 64u << 20;
+
+const std::string frame::Compression = " zlib";
+const std::string frame::Handles = " handles";
+
+static std::string hello (io::IOStream stream, std::string request) {
+	*stream << call::Request (request);
+	stream->flush();
+	Either <call::Exception, call::Response> reply;
+	*stream >> reply;
+	boost::optional<call::Response> r = reply.mRight();
+	return r ? r->data : "";
+}
+
+static void put32 (char* p, boost::uint32_t x) {
+	p[0] = (char) (x >> 24); p[1] = (char) (x >> 16); p[2] = (char) (x >> 8); p[3] = (char) x;
+}
+
+static boost::uint32_t get32 (const char* p) {
+	const unsigned char* u = (const unsigned char*) p;
+	return ((boost::uint32_t) u[0] << 24) | ((boost::uint32_t) u[1] << 16) | ((boost::uint32_t) u[2] << 8) | u[3];
+}
+
+/** Whether text is prefix alone or followed by space separated words, and if so set whether Compression and Handles are among them. Unknown words are ignored */
+static bool parseSuffixes (const std::string &text, const std::string &prefix, bool &compress, bool &handles) {
+	if (text.compare (0, prefix.size(), prefix) != 0 || (text.size() > prefix.size() && text[prefix.size()] != ' ')) return false;
+	compress = handles = false;
+	std::istringstream words (text.substr (prefix.size()));
+	std::string word;
+	while (words >> word) {
+		if (" " + word == frame::Compression) compress = true;
+		else if (" " + word == frame::Handles) handles = true;
+	}
+	return true;
+}
+
+bool frame::isOtherHello (const std::string &request, std::string &refusal) {
+	if (request.compare (0, HelloPrefix.size(), HelloPrefix) != 0 || request.compare (0, Hello.size(), Hello) == 0) return false;
+	std::string version = request.substr (1, request.find (' ') == std::string::npos ? std::string::npos : request.find (' ') - 1);
+	refusal = "Client speaks " + version + " but this server " + Hello.substr (1) + ": upgrade client and server together";
+	return true;
+}
+
+bool frame::isHello (const std::string &request, bool &compress, bool &handles) {
+	return parseSuffixes (request, Hello, compress, handles);
+}
+
+std::string frame::helloAck (bool compress, bool handles) {
+	return HelloAck + (compress ? Compression : "") + (handles ? Handles : "");
+}
+
+/** An older server tries to run Hello as a request and replies an error, or an echo server replies Hello back. Servers of this version ignore suffixes they do not know. One that agrees to switch to frames of version 2 cannot decode our requests, so we refuse it, while a server that only speaks text may still serve requests that are not closures */
+bool frame::negotiate (io::IOStream stream, bool &compress, bool &handles) {
+	compress = handles = false;
+	if (parseSuffixes (hello (stream, Hello + (compression::enabled ? Compression : "") + Handles), HelloAck, compress, handles)) return true;
+	if (hello (stream, Hello2) == Hello2Ack) throw std::runtime_error ("Server speaks " + Hello2.substr (1) + " but this client " + Hello.substr (1) + ": upgrade client and server together");
+	return false;
+}
+
+/** Header is stored big-endian: length (4 bytes), type, flags, version (2 bytes), id (4 bytes) */
+static void putHeader (char* header, boost::uint32_t length, frame::Type type, boost::uint8_t flags, boost::uint32_t id) {
+	put32 (header, length);
+	header[4] = (char) type;
+	header[5] = (char) flags;
+	header[6] = (char) (frame::Version >> 8);
+	header[7] = (char) frame::Version;
+	put32 (header + 8, id);
+}
+
+frame::Header frame::parseHeader (const char* header) {
+	Header h;
+	h.length = get32 (header);
+	h.type = header[4];
+	h.flags = header[5];
+	h.version = ((boost::uint16_t) (unsigned char) header[6] << 8) | (unsigned char) header[7];
+	h.id = get32 (header + 8);
+	if (h.version != Version) throw std::runtime_error ("Unknown frame version " + to_string (h.version));
+	if (h.length > maxLength) throw std::runtime_error ("Frame too large: " + to_string (h.length));
+	return h;
+}
+
+void frame::write (std::ostream &out, Type type, boost::uint8_t flags, boost::uint32_t id, const std::string &body) {
+	char header [HeaderSize];
+	putHeader (header, body.size(), type, flags, id);
+	out.write (header, HeaderSize);
+	out.write (body.data(), body.size());
+}
+
+std::string frame::encode (Type type, boost::uint8_t flags, boost::uint32_t id, const std::string &body) {
+	std::string bytes (HeaderSize, '\0');
+	putHeader (&bytes[0], body.size(), type, flags, id);
+	return bytes + body;
+}
+
+/** Bytes of a body read at a time */
+static const size_t ReadChunk = 64 * 1024;
+
+bool frame::read (std::istream &in, Header &h, std::string &body) {
+	char header [HeaderSize];
+	in.read (header, HeaderSize);
+	if (in.gcount() == 0 && in.eof()) return false;
+	if (!in) throw std::runtime_error ("Truncated frame header");
+	h = parseHeader (header);
+	std::string data;
+	while (data.size() < h.length) { // grown as bytes arrive, not by what the header claims
+		size_t start = data.size();
+		data.resize (start + std::min ((size_t) (h.length - start), ReadChunk));
+		in.read (&data[start], data.size() - start);
+		if (!in) throw std::runtime_error ("Truncated frame body");
+	}
+	body.swap (data);
+	return true;
+}
+
+std::string frame::encodeCredit (boost::uint32_t chunks) {
+	char body [4];
+	put32 (body, chunks);
+	return std::string (body, 4);
+}
+
+boost::uint32_t frame::decodeCredit (const std::string &body) {
+	if (body.size() != 4) throw std::runtime_error ("Corrupt credit frame");
+	return get32 (body.data());
+}
+
+/** Length of error type (4 bytes), error type, then error message */
+std::string frame::encodeError (const call::Exception &e) {
+	char length [4];
+	put32 (length, e.errorType.size());
+	return std::string (length, 4) + e.errorType + e.errorMessage;
+}
+
+call::Exception frame::decodeError (const std::string &body) {
+	if (body.size() < 4 || get32 (body.data()) > body.size() - 4) throw std::runtime_error ("Corrupt error frame");
+	boost::uint32_t n = get32 (body.data());
+	call::Exception e;
+	e.errorType = body.substr (4, n);
+	e.errorMessage = body.substr (4 + n);
+	return e;
+}
@@ -0,0 +1,88 @@
+/* Binary framing of the call protocol. Each message is a fixed size header (body length, message type, flags, protocol version and request id) followed by its body, so a whole message is read with a single read and its body handed on as is.
+ * A response carries the id of its request, so a client may have many requests outstanding on one connection and the server may answer them out of order.
+ * A connection starts in the text protocol. The client asks to switch by sending `Hello` as a request; a server that understands frames replies `HelloAck` and both ends use frames from then on. Older servers reply something else and the connection stays in the text protocol. Hello may ask for optional features as suffixes, and HelloAck carries those the server grants.
+ * Hello names the protocol version, which changes whenever what requests carry does, as version 3 did with the encoding of closure args (see args.h). Peers of different versions refuse each other at Hello with an error, rather than fail to decode each other's requests. */
+
+#pragma once
+
+#include <string>
+#include <iostream>
+#include <boost/cstdint.hpp>
+#include "call.h"
+
+namespace frame {
+
+	const boost::uint16_t Version = 3;
+
+	enum Type {
+		Request = 1,
+		Response = 2,
+		Error = 3,  // body is an encoded call::Exception
+		Ping = 4,  // health probe. Server answers at once with an empty Ping of the same id, without queueing it behind requests
+		Chunk = 5,  // part of the result of a Streamed request, sent before its Response (see streaming.h)
+		Credit = 6  // client consumed chunks of a Streamed request, body is their number (encodeCredit), or 0 if it stopped reading
+	};
+
+	enum Flags {
+		Concurrent = 1,  // request may run concurrently with later requests on its connection. Without it requests run in order
+		Bulk = 2,  // request is long running work that should not delay interactive requests (see executor.h)
+		Compressed = 4,  // body is compressed (see compression.h). Only sent on connections that negotiated compression
+		Streamed = 8  // request wants its result in Chunks as it is produced. Implies Concurrent
+	};
+
+	struct Header {
+		boost::uint32_t length;  // of body
+		boost::uint8_t type;
+		boost::uint8_t flags;
+		boost::uint16_t version;
+		boost::uint32_t id;  // of request, echoed by its response
+		Header (boost::uint32_t length, Type type, boost::uint8_t flags, boost::uint32_t id) : length(length), type(type), flags(flags), version(Version), id(id) {}
+		Header () : length(0), type(0), flags(0), version(0), id(0) {}
+	};
+
+	const unsigned HeaderSize = 12;
+
+	/** Bodies larger than this are rejected as corrupt, and connections sending them closed. Default 64MB. Set the same on clients and servers */
+	extern boost::uint32_t maxLength;
+
+	/** Text request asking server to switch connection to frames, and its reply if it agrees */
+	extern const std::string Hello;
+	extern const std::string HelloAck;
+
+	/** Suffix of Hello offering compression, and of HelloAck accepting it */
+	extern const std::string Compression;
+
+	/** Suffix of Hello asking for function handles (see intern.h), and of HelloAck granting them */
+	extern const std::string Handles;
+
+	/** If request is the Hello of another protocol version, set `refusal` to the error server answers it and every later request of the connection with, and return true */
+	bool isOtherHello (const std::string &request, std::string &refusal);
+
+	/** Whether request is a Hello, and if so set whether it asks for compression and handles */
+	bool isHello (const std::string &request, bool &compress, bool &handles);
+
+	/** HelloAck granting compression and handles as given */
+	std::string helloAck (bool compress, bool handles);
+
+	/** Ask server on other end of new connection to switch to frames (see above), offering compression if compression::enabled and asking for handles. Return true if it did, and set `compress` and `handles` to what it granted. Throw if server speaks frames of an older version */
+	bool negotiate (io::IOStream, bool &compress, bool &handles);
+
+	/** Write header and body, without flushing */
+	void write (std::ostream&, Type, boost::uint8_t flags, boost::uint32_t id, const std::string &body);
+
+	/** Whole frame as bytes */
+	std::string encode (Type, boost::uint8_t flags, boost::uint32_t id, const std::string &body);
+
+	/** Decode header from its HeaderSize bytes. Throw if version is unknown or length too large */
+	Header parseHeader (const char*);
+
+	/** Read next frame, swapping its body into `body`. Return false if connection closed before a header. Throw if version is unknown or frame is truncated */
+	bool read (std::istream&, Header&, std::string &body);
+
+	std::string encodeCredit (boost::uint32_t chunks);
+	boost::uint32_t decodeCredit (const std::string &body);
+
+	std::string encodeError (const call::Exception&);
+	call::Exception decodeError (const std::string &body);
+
+}
@@ -13,17 +13,21 @@ compile::LinkContext _function::defFunction (unsigned N, module::Module mod, std
 	ctx.includePaths.push_back ("/usr/local/include");
 	ctx.libNames.push_back ("boost_serialization-mt");
 	ctx.libNames.push_back ("10util");
+	ctx.libNames.push_back ("10remote");
 	ctx.headers.push_back ("#include <10util/io.h>");
+	ctx.headers.push_back ("#include <10remote/args.h>");
+	ctx.headers.push_back ("#include <10remote/phase.h>");
 	ctx.headers.push_back ("#include <cassert>");
 	std::stringstream ss;
 	unsigned Z = funSig.argTypes.size();
-	ss << funSig.returnType << " " << funName << " (std::vector<io::Code> args";
+	ss << "static " << funSig.returnType << " " << funName << " (const remote::Args &args"; // static so stubs loaded together do not bind to each other's
 	for (unsigned i = Z-N; i < Z; i++)
 		ss << ", " << funSig.argTypes[i] << " arg" << i;
 	ss << ") {\n";
 	ss << "\tassert (args.size() == " << Z-N << ");\n";
 	for (unsigned i = 0; i < Z-N; i++)
-		ss << "\t" << funSig.argTypes[i] << " arg" << i << " = io::decode< " << funSig.argTypes[i] << " > (args[" << i << "]);\n";
+		ss << "\t" << funSig.argTypes[i] << " arg" << i << " = args.get< " << funSig.argTypes[i] << " > (" << i << ");\n";
+	ss << "\tmetrics::mark (metrics::Execute);\n";
 	ss << "\treturn " << funSig.funName << " (";
 	for (unsigned i = 0; i < Z; i++) {
 		ss << "arg" << i;
@@ -40,13 +44,14 @@ compile::LinkContext _function::defFunction0c (module::Module module, std::strin
 	compile::LinkContext ctx = defFunction (0, module, "x_" + funName, funSig);
 	ctx.headers.push_back ("#include <10util/unit.h>");
 	std::stringstream ss;
-	ss << "io::Code " << funName << " (std::vector<io::Code> args) {\n";
+	ss << "static io::Code " << funName << " (const remote::Args &args) {\n";
 	if (funSig.returnType == "void") {
 		ss << "\tx_" << funName << " (args);\n";
 		ss << "\tUnit result = unit;\n";
 	} else {
 		ss << "\t" << funSig.returnType << " result = x_" << funName << " (args);\n";
 	}
+	ss << "\tmetrics::mark (metrics::Encode);\n";
 	ss << "\treturn io::encode (result);\n";
 	ss << "}\n";
 	ctx.headers.push_back (ss.str());
@@ -54,12 +59,12 @@ compile::LinkContext _function::defFunction0c (module::Module module, std::strin
 }
 
 /** Cache of previously compiled functions for getFunctionN, so we don't recompile the same function every time */
-std::map < remote::FunctionId, boost::shared_ptr<void> > _function::cache0; // void is cast of boost::function1<O,io::Code>
-std::map < remote::FunctionId, boost::shared_ptr<void> > _function::cache1; // void is cast of boost::function1<O,io::Code,I>
-std::map < remote::FunctionId, boost::shared_ptr<void> > _function::cache2; // void is cast of boost::function1<O,io::Code,I,J>
-std::map < remote::FunctionId, boost::shared_ptr<void> > _function::cache3; // void is cast of boost::function1<O,io::Code,I,J,K>
-std::map < remote::FunctionId, boost::shared_ptr<void> > _function::cache4; // void is cast of boost::function1<O,io::Code,I,J,K,L>
-std::map < remote::FunctionId, boost::shared_ptr< boost::function1<io::Code,std::vector<io::Code> > > > _function::cache0c; // for getFunction0c
+cache::Cache < remote::FunctionId, void > _function::cache0; // void is cast of boost::function1<O,io::Code>
+cache::Cache < remote::FunctionId, void > _function::cache1; // void is cast of boost::function1<O,io::Code,I>
+cache::Cache < remote::FunctionId, void > _function::cache2; // void is cast of boost::function1<O,io::Code,I,J>
+cache::Cache < remote::FunctionId, void > _function::cache3; // void is cast of boost::function1<O,io::Code,I,J,K>
+cache::Cache < remote::FunctionId, void > _function::cache4; // void is cast of boost::function1<O,io::Code,I,J,K,L>
+cache::Cache < remote::FunctionId, boost::function1<io::Code,remote::Args> > _function::cache0c; // for getFunction0c
 
 module::Module remote::composeAct0_module = mod;
 module::Module remote::composeAct1_module = mod;
@@ -9,6 +9,9 @@
 #include <10util/compile.h>
 #include <10util/type.h>
 #include <10util/module.h>
+#include "stubcache.h"
+#include "cache.h"
+#include "args.h"
 #include <boost/shared_ptr.hpp>
 #include <map>
 #include <10util/util.h> // output vector
@@ -56,6 +59,8 @@ public:
 };
 }
 
+inline std::ostream& operator<< (std::ostream& out, const remote::FunctionId &x); // for Loading message below
+
 namespace _function {
 
 /** Function transformed to take serial stream of first Z-N args, where Z is total num of args */
@@ -64,37 +69,37 @@ compile::LinkContext defFunction (unsigned N, module::Module module, std::string
 compile::LinkContext defFunction0c (module::Module module, std::string funName, remote::FunSignature funSig);
 
 /** Return this function in its serialized args form. O type must match function return type */
-template <class O> boost::function1<O,std::vector<io::Code> > compileFunction0 (const remote::FunctionId &fun) {
+template <class O> boost::function1<O,remote::Args> compileFunction0 (const remote::FunctionId &fun) {
 	assert (typeName<O>() == fun.funSig.returnType);
 	compile::LinkContext ctx = defFunction (0, fun.module, "serialArgsFun", fun.funSig);
 	ctx.headers.push_back ("#include <boost/bind.hpp>");
-	return compile::eval< boost::function1<O,std::vector<io::Code> > > (ctx, "boost::bind (serialArgsFun, _1)");
+	return compile::eval< boost::function1<O,remote::Args> > (ctx, "boost::bind (serialArgsFun, _1)");
 }
-template <class O, class I> boost::function2<O,std::vector<io::Code>,I> compileFunction1 (const remote::FunctionId &fun) {
+template <class O, class I> boost::function2<O,remote::Args,I> compileFunction1 (const remote::FunctionId &fun) {
 	assert (typeName<O>() == fun.funSig.returnType);
 	assert (typeName<I>() == *(fun.funSig.argTypes.end() - 1));
 	compile::LinkContext ctx = defFunction (1, fun.module, "serialArgsFun", fun.funSig);
 	ctx.headers.push_back ("#include <boost/bind.hpp>");
-	return compile::eval< boost::function2<O,std::vector<io::Code>,I> > (ctx, "boost::bind (serialArgsFun, _1, _2)");
+	return compile::eval< boost::function2<O,remote::Args,I> > (ctx, "boost::bind (serialArgsFun, _1, _2)");
 }
-template <class O, class I, class J> boost::function3<O,std::vector<io::Code>,I,J> compileFunction2 (const remote::FunctionId &fun) {
+template <class O, class I, class J> boost::function3<O,remote::Args,I,J> compileFunction2 (const remote::FunctionId &fun) {
 	assert (typeName<O>() == fun.funSig.returnType);
 	assert (typeName<I>() == *(fun.funSig.argTypes.end() - 2));
 	assert (typeName<J>() == *(fun.funSig.argTypes.end() - 1));
 	compile::LinkContext ctx = defFunction (2, fun.module, "serialArgsFun", fun.funSig);
 	ctx.headers.push_back ("#include <boost/bind.hpp>");
-	return compile::eval< boost::function3<O,std::vector<io::Code>,I,J> > (ctx, "boost::bind (serialArgsFun, _1, _2, _3)");
+	return compile::eval< boost::function3<O,remote::Args,I,J> > (ctx, "boost::bind (serialArgsFun, _1, _2, _3)");
 }
-template <class O, class I, class J, class K> boost::function4<O,std::vector<io::Code>,I,J,K> compileFunction3 (const remote::FunctionId &fun) {
+template <class O, class I, class J, class K> boost::function4<O,remote::Args,I,J,K> compileFunction3 (const remote::FunctionId &fun) {
 	assert (typeName<O>() == fun.funSig.returnType);
 	assert (typeName<I>() == *(fun.funSig.argTypes.end() - 3));
 	assert (typeName<J>() == *(fun.funSig.argTypes.end() - 2));
 	assert (typeName<K>() == *(fun.funSig.argTypes.end() - 1));
 	compile::LinkContext ctx = defFunction (3, fun.module, "serialArgsFun", fun.funSig);
 	ctx.headers.push_back ("#include <boost/bind.hpp>");
-	return compile::eval< boost::function4<O,std::vector<io::Code>,I,J,K> > (ctx, "boost::bind (serialArgsFun, _1, _2, _3, _4)");
+	return compile::eval< boost::function4<O,remote::Args,I,J,K> > (ctx, "boost::bind (serialArgsFun, _1, _2, _3, _4)");
 }
-template <class O, class I, class J, class K, class L> boost::function5<O,std::vector<io::Code>,I,J,K,L> compileFunction4 (const remote::FunctionId &fun) {
+template <class O, class I, class J, class K, class L> boost::function5<O,remote::Args,I,J,K,L> compileFunction4 (const remote::FunctionId &fun) {
 	assert (typeName<O>() == fun.funSig.returnType);
 	assert (typeName<I>() == *(fun.funSig.argTypes.end() - 4));
 	assert (typeName<J>() == *(fun.funSig.argTypes.end() - 3));
@@ -102,65 +107,63 @@ template <class O, class I, class J, class K, class L> boost::function5<O,std::v
 	assert (typeName<L>() == *(fun.funSig.argTypes.end() - 1));
 	compile::LinkContext ctx = defFunction (4, fun.module, "serialArgsFun", fun.funSig);
 	ctx.headers.push_back ("#include <boost/bind.hpp>");
-	return compile::eval< boost::function5<O,std::vector<io::Code>,I,J,K,L> > (ctx, "boost::bind (serialArgsFun, _1, _2, _3, _4, _5)");
+	return compile::eval< boost::function5<O,remote::Args,I,J,K,L> > (ctx, "boost::bind (serialArgsFun, _1, _2, _3, _4, _5)");
 }
 
-/** Return this function in its serialized args and output form */
-inline boost::function1<io::Code,std::vector<io::Code> > compileFunction0c (const remote::FunctionId &fun) {
+/** Return this function in its serialized args and output form. Compiled stub is kept in stubcache so it survives server restarts */
+inline boost::function1<io::Code,remote::Args> compileFunction0c (const remote::FunctionId &fun) {
 	compile::LinkContext ctx = defFunction0c (fun.module, "serialArgsOutFun", fun.funSig);
+	ctx.headers.push_back ("#include <boost/function.hpp>");
 	ctx.headers.push_back ("#include <boost/bind.hpp>");
-	return compile::eval< boost::function1<io::Code,std::vector<io::Code> > > (ctx, "boost::bind (serialArgsOutFun, _1)");
+	return stubcache::eval< boost::function1<io::Code,remote::Args> > (ctx, "boost::function1<io::Code,remote::Args>", "boost::bind (serialArgsOutFun, _1)");
 }
 
-/** Cache of previously compiled functions for getFunctionN, so we don't recompile the same function every time */
-extern std::map < remote::FunctionId, boost::shared_ptr<void> > cache0; // void = boost::function1<O,io::Code>
-extern std::map < remote::FunctionId, boost::shared_ptr<void> > cache1; // void = boost::function1<O,io::Code,I>
-extern std::map < remote::FunctionId, boost::shared_ptr<void> > cache2; // void = boost::function1<O,io::Code,I,J>
-extern std::map < remote::FunctionId, boost::shared_ptr<void> > cache3; // void = boost::function1<O,io::Code,I,J,K>
-extern std::map < remote::FunctionId, boost::shared_ptr<void> > cache4; // void = boost::function1<O,io::Code,I,J,K,L>
-extern std::map < remote::FunctionId, boost::shared_ptr< boost::function1<io::Code,std::vector<io::Code> > > > cache0c; // getFunction0c
-
-template <class K, class V> V cached (std::map < K, boost::shared_ptr<void> > &cache, V (*proc) (const K &), const K &key) {
-	boost::shared_ptr<void> ptr = cache [key];
-	if (!ptr) {
-		std::cout << "Loading: " << key << std::endl;
-		V val = proc (key);
-		ptr = boost::static_pointer_cast <void,V> (boost::shared_ptr<V> (new V (val)));
-		cache [key] = ptr;
-	}
+/** Cache of previously compiled functions for getFunctionN, so we don't recompile the same function every time. Safe to use from concurrent connection threads */
+extern cache::Cache < remote::FunctionId, void > cache0; // void = boost::function1<O,io::Code>
+extern cache::Cache < remote::FunctionId, void > cache1; // void = boost::function1<O,io::Code,I>
+extern cache::Cache < remote::FunctionId, void > cache2; // void = boost::function1<O,io::Code,I,J>
+extern cache::Cache < remote::FunctionId, void > cache3; // void = boost::function1<O,io::Code,I,J,K>
+extern cache::Cache < remote::FunctionId, void > cache4; // void = boost::function1<O,io::Code,I,J,K,L>
+extern cache::Cache < remote::FunctionId, boost::function1<io::Code,remote::Args> > cache0c; // getFunction0c
+
+template <class K, class V> boost::shared_ptr<void> load (V (*proc) (const K &), K key) {
+	std::cerr << "Loading: " << key << std::endl;
+	return boost::static_pointer_cast <void,V> (boost::shared_ptr<V> (new V (proc (key))));
+}
+
+template <class K, class V> V cached (cache::Cache < K, void > &cache, V (*proc) (const K &), const K &key) {
+	boost::shared_ptr<void> ptr = cache.get (key, boost::bind (load<K,V>, proc, key));
 	return * boost::static_pointer_cast<V> (ptr);
 }
 
 /** getFunctionN returns function in form where it can take its first Z-N args in serial form and the remaining N args in typed form, where Z is total number of args that function takes. */
-template <class O> boost::function1<O,std::vector<io::Code> > getFunction0 (const remote::FunctionId &fun) {
+template <class O> boost::function1<O,remote::Args> getFunction0 (const remote::FunctionId &fun) {
 	return cached (cache0, compileFunction0<O>, fun);}
-template <class O, class I> boost::function2<O,std::vector<io::Code>,I> getFunction1 (const remote::FunctionId &fun) {
+template <class O, class I> boost::function2<O,remote::Args,I> getFunction1 (const remote::FunctionId &fun) {
 	return cached (cache1, compileFunction1<O,I>, fun);}
-template <class O, class I, class J> boost::function3<O,std::vector<io::Code>,I,J> getFunction2 (const remote::FunctionId &fun) {
+template <class O, class I, class J> boost::function3<O,remote::Args,I,J> getFunction2 (const remote::FunctionId &fun) {
 	return cached (cache2, compileFunction2<O,I,J>, fun);}
-template <class O, class I, class J, class K> boost::function4<O,std::vector<io::Code>,I,J,K> getFunction3 (const remote::FunctionId &fun) {
+template <class O, class I, class J, class K> boost::function4<O,remote::Args,I,J,K> getFunction3 (const remote::FunctionId &fun) {
 	return cached (cache3, compileFunction3<O,I,J,K>, fun);}
-template <class O, class I, class J, class K, class L> boost::function5<O,std::vector<io::Code>,I,J,K,L> getFunction4 (const remote::FunctionId &fun) {
+template <class O, class I, class J, class K, class L> boost::function5<O,remote::Args,I,J,K,L> getFunction4 (const remote::FunctionId &fun) {
 	return cached (cache4, compileFunction4<O,I,J,K,L>, fun);}
 
-/** Same as getFunction0 except also serialize result */
-inline boost::function1<io::Code,std::vector<io::Code> > getFunction0c (const remote::FunctionId &funId) {
-	boost::shared_ptr< boost::function1<io::Code,std::vector<io::Code> > > funPtr = cache0c [funId];
-	if (!funPtr) {
-
-		std::cout << "Loading: " << funId.module << " ";
-		std::cout << funId.funSig.returnType << " " << funId.funSig.funName << " (";
-		for (unsigned i = 0; i < funId.funSig.argTypes.size(); i++) {
-			std::cout << funId.funSig.argTypes[i];
-			if (i < funId.funSig.argTypes.size() - 1) std::cout << ", ";
-		}
-		std::cout << ")" << std::endl;
-
-		boost::function1<io::Code,std::vector<io::Code> > fun = compileFunction0c (funId);
-		funPtr = boost::shared_ptr< boost::function1<io::Code,std::vector<io::Code> > > (new boost::function1<io::Code,std::vector<io::Code> > (fun));
-		cache0c [funId] = funPtr;
+inline boost::shared_ptr< boost::function1<io::Code,remote::Args> > loadFunction0c (remote::FunctionId funId) {
+	std::cerr << "Loading: " << funId.module << " ";
+	std::cerr << funId.funSig.returnType << " " << funId.funSig.funName << " (";
+	for (unsigned i = 0; i < funId.funSig.argTypes.size(); i++) {
+		std::cerr << funId.funSig.argTypes[i];
+		if (i < funId.funSig.argTypes.size() - 1) std::cerr << ", ";
 	}
-	return * funPtr;
+	std::cerr << ")" << std::endl;
+
+	boost::function1<io::Code,remote::Args> fun = compileFunction0c (funId);
+	return boost::shared_ptr< boost::function1<io::Code,remote::Args> > (new boost::function1<io::Code,remote::Args> (fun));
+}
+
+/** Same as getFunction0 except also serialize result */
+inline boost::function1<io::Code,remote::Args> getFunction0c (const remote::FunctionId &funId) {
+	return * cache0c.get (funId, boost::bind (loadFunction0c, funId));
 }
 
 }
@@ -170,11 +173,14 @@ namespace remote {
 /** Capture the first N args of a function application. N does not have to be all args and can be 0 */
 struct Closure {
 	FunctionId fun;
-	std::vector<io::Code> args;
+	Args args;
 	Closure (FunctionId fun) : fun(fun) {} // empty args
-	Closure (FunctionId fun, std::vector<io::Code> args) : fun(fun), args(args) {}
+	Closure (FunctionId fun, Args args) : fun(fun), args(args) {}
 	Closure () {} // for serialization
-	template <class A> Closure plusArg (A arg) {return Closure (fun, add (args, io::encode (arg)));}
+	/** Append arg in place */
+	template <class A> Closure& addArg (const A &arg) {args.add (arg); return *this;}
+	/** Copy with arg appended */
+	template <class A> Closure plusArg (const A &arg) {Closure c (*this); c.args.add (arg); return c;}
 	/** operator() only applicable when all args have been captured */
 	io::Code operator() () {
 		try {
@@ -292,27 +298,37 @@ template <class O, class I, class J, class K, class L> Function4<O,I,J,K,L> fun
 
 namespace remote {
 
-/** Capture first N args to be applied to function later (similar to boost::bind) */
+/** Capture first N args to be applied to function later (similar to boost::bind). Args are appended to fun's own copy of its closure, so binding copies nothing but the args */
 template <class O, class I> Function0<O> bind (Function1<O,I> fun, I arg1) {
-	return Function0<O> (fun.closure.plusArg(arg1));}
+	fun.closure.addArg(arg1);
+	return Function0<O> (fun.closure);}
 template <class O, class I, class J> Function0<O> bind (Function2<O,I,J> fun, I arg1, J arg2) {
-	return Function0<O> (fun.closure.plusArg(arg1).plusArg(arg2));}
+	fun.closure.addArg(arg1).addArg(arg2);
+	return Function0<O> (fun.closure);}
 template <class O, class I, class J, class K> Function0<O> bind (Function3<O,I,J,K> fun, I arg1, J arg2, K arg3) {
-	return Function0<O> (fun.closure.plusArg(arg1).plusArg(arg2).plusArg(arg3));}
+	fun.closure.addArg(arg1).addArg(arg2).addArg(arg3);
+	return Function0<O> (fun.closure);}
 template <class O, class I, class J, class K, class L> Function0<O> bind (Function4<O,I,J,K,L> fun, I arg1, J arg2, K arg3, L arg4) {
-	return Function0<O> (fun.closure.plusArg(arg1).plusArg(arg2).plusArg(arg3),plusArg(arg4));}
+	fun.closure.addArg(arg1).addArg(arg2).addArg(arg3).addArg(arg4);
+	return Function0<O> (fun.closure);}
 template <class O, class I, class J> Function1<O,J> bind (Function2<O,I,J> fun, I arg1) {
-	return Function1<O,J> (fun.closure.plusArg(arg1));}
+	fun.closure.addArg(arg1);
+	return Function1<O,J> (fun.closure);}
 template <class O, class I, class J, class K> Function1<O,K> bind (Function3<O,I,J,K> fun, I arg1, J arg2) {
-	return Function1<O,K> (fun.closure.plusArg(arg1).plusArg(arg2));}
+	fun.closure.addArg(arg1).addArg(arg2);
+	return Function1<O,K> (fun.closure);}
 template <class O, class I, class J, class K, class L> Function1<O,L> bind (Function4<O,I,J,K,L> fun, I arg1, J arg2, K arg3) {
-	return Function1<O,L> (fun.closure.plusArg(arg1).plusArg(arg2).plusArg(arg3));}
+	fun.closure.addArg(arg1).addArg(arg2).addArg(arg3);
+	return Function1<O,L> (fun.closure);}
 template <class O, class I, class J, class K> Function2<O,J,K> bind (Function3<O,I,J,K> fun, I arg1) {
-	return Function2<O,J,K> (fun.closure.plusArg(arg1));}
+	fun.closure.addArg(arg1);
+	return Function2<O,J,K> (fun.closure);}
 template <class O, class I, class J, class K, class L> Function2<O,K,L> bind (Function4<O,I,J,K,L> fun, I arg1, J arg2) {
-	return Function2<O,K,L> (fun.closure.plusArg(arg1).plusArg(arg2));}
+	fun.closure.addArg(arg1).addArg(arg2);
+	return Function2<O,K,L> (fun.closure);}
 template <class O, class I, class J, class K, class L> Function3<O,J,K,L> bind (Function4<O,I,J,K,L> fun, I arg1) {
-	return Function3<O,J,K,L> (fun.closure.plusArg(arg1));}
+	fun.closure.addArg(arg1);
+	return Function3<O,J,K,L> (fun.closure);}
 
 
 template <class B, class A, class I> B _composeAct1 (Function1<B,A> act2, Function1<A,I> act1, I i) {return act2 (act1 (i));}
@@ -0,0 +1,195 @@
+/* Result of an asynchronous operation, eg. a call waiting for its response. Unlike boost::shared_future, you can attach continuations that run when the result arrives, so waiting on many operations does not take a thread per operation.
+ * Continuations run on the thread that completes the future (eg. a channel's reader thread), or immediately if already complete, so they should be short. */
+
+#pragma once
+
+#include <vector>
+#include <stdexcept>
+#include <boost/shared_ptr.hpp>
+#include <boost/optional.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <10util/unit.h>
+
+namespace future {
+
+template <class T> class Promise;
+
+/** Storage of a T, which is Unit for void */
+template <class T> struct Slot {
+	typedef T type;
+	static T get (const boost::optional<T> &x) {return *x;}
+};
+template <> struct Slot<void> {
+	typedef Unit type;
+	static void get (const boost::optional<Unit> &x) {}
+};
+
+template <class T> class Future {
+	friend class Promise<T>;
+	struct State {
+		boost::mutex mutex;
+		boost::condition_variable ready;
+		bool done;
+		boost::optional<typename Slot<T>::type> value;
+		boost::exception_ptr error;
+		std::vector< boost::function0<void> > continuations;
+		State () : done(false) {}
+	};
+	boost::shared_ptr<State> state;
+	Future (boost::shared_ptr<State> state) : state(state) {}
+public:
+	Future () {} // invalid until assigned
+
+	bool isReady () const {
+		boost::lock_guard<boost::mutex> lock (state->mutex);
+		return state->done;
+	}
+
+	void wait () const {
+		boost::unique_lock<boost::mutex> lock (state->mutex);
+		while (!state->done) state->ready.wait (lock);
+	}
+
+	/** Wait at most timeout for result. Whether it is ready */
+	bool wait (boost::posix_time::time_duration timeout) const {
+		boost::system_time until = boost::get_system_time() + timeout;
+		boost::unique_lock<boost::mutex> lock (state->mutex);
+		while (!state->done)
+			if (!state->ready.timed_wait (lock, until)) return state->done;
+		return true;
+	}
+
+	/** Wait for result and return it, or rethrow its exception */
+	T get () const {
+		wait ();
+		if (state->error) boost::rethrow_exception (state->error);
+		return Slot<T>::get (state->value);
+	}
+
+	bool hasError () const {
+		wait ();
+		return !!state->error;
+	}
+
+	/** Run continuation when ready */
+	void onReady (boost::function0<void> continuation) const {
+		{
+			boost::lock_guard<boost::mutex> lock (state->mutex);
+			if (!state->done) {
+				state->continuations.push_back (continuation);
+				return;
+			}
+		}
+		continuation ();
+	}
+
+	/** Future of applying f to this future once it is ready */
+	template <class U> Future<U> then (boost::function1<U,Future> f) const;
+};
+
+template <class T> class Promise {
+	boost::shared_ptr<typename Future<T>::State> state;
+	void complete () {
+		std::vector< boost::function0<void> > continuations;
+		{
+			boost::lock_guard<boost::mutex> lock (state->mutex);
+			if (state->done) throw std::logic_error ("Promise already fulfilled");
+			state->done = true;
+			continuations.swap (state->continuations);
+		}
+		state->ready.notify_all ();
+		for (unsigned i = 0; i < continuations.size(); i++) continuations[i] ();
+	}
+public:
+	Promise () : state (new typename Future<T>::State) {}
+	Future<T> future () const {return Future<T> (state);}
+	void setValue (typename Slot<T>::type value) {
+		{
+			boost::lock_guard<boost::mutex> lock (state->mutex);
+			state->value = value;
+		}
+		complete ();
+	}
+	void setError (boost::exception_ptr error) {
+		{
+			boost::lock_guard<boost::mutex> lock (state->mutex);
+			state->error = error;
+		}
+		complete ();
+	}
+	/** Set error from exception being handled, keeping its type so `get` raises the same */
+	void setError (const std::exception&) {setError (boost::current_exception());}
+};
+
+/** Future that is already complete */
+template <class T> Future<T> value (typename Slot<T>::type x) {
+	Promise<T> p;
+	p.setValue (x);
+	return p.future();
+}
+
+template <class U, class T> struct Fulfil {
+	static void run (Promise<U> p, boost::function1<U,Future<T> > f, Future<T> x) {
+		try {p.setValue (f (x));}
+		catch (std::exception &e) {p.setError (e);}
+	}
+};
+template <class T> struct Fulfil<void,T> {
+	static void run (Promise<void> p, boost::function1<void,Future<T> > f, Future<T> x) {
+		try {f (x); p.setValue (unit);}
+		catch (std::exception &e) {p.setError (e);}
+	}
+};
+
+template <class T> template <class U> Future<U> Future<T>::then (boost::function1<U,Future> f) const {
+	Promise<U> p;
+	onReady (boost::bind (Fulfil<U,T>::run, p, f, *this));
+	return p.future();
+}
+
+/** Counts down futures of whenAll / whenAny */
+template <class T> struct Gather {
+	boost::mutex mutex;
+	std::vector< Future<T> > futures;
+	unsigned remaining;
+	Promise< std::vector< Future<T> > > all;
+	Promise<unsigned> any;
+	bool anyDone;
+	Gather (std::vector< Future<T> > futures) : futures(futures), remaining(futures.size()), anyDone(false) {}
+};
+
+template <class T> void gatherOne (boost::shared_ptr< Gather<T> > g, unsigned i) {
+	bool first, last;
+	{
+		boost::lock_guard<boost::mutex> lock (g->mutex);
+		first = !g->anyDone;
+		g->anyDone = true;
+		last = --g->remaining == 0;
+	}
+	if (first) g->any.setValue (i);
+	if (last) g->all.setValue (g->futures);
+}
+
+/** Future that is ready when all given futures are ready. Its value is the given futures */
+template <class T> Future< std::vector< Future<T> > > whenAll (std::vector< Future<T> > futures) {
+	boost::shared_ptr< Gather<T> > g (new Gather<T> (futures));
+	if (futures.empty()) g->all.setValue (futures);
+	for (unsigned i = 0; i < futures.size(); i++) futures[i].onReady (boost::bind (gatherOne<T>, g, i));
+	return g->all.future();
+}
+
+/** Future that is ready when the first of given futures is ready. Its value is that future's index */
+template <class T> Future<unsigned> whenAny (std::vector< Future<T> > futures) {
+	if (futures.empty()) throw std::invalid_argument ("whenAny of no futures");
+	boost::shared_ptr< Gather<T> > g (new Gather<T> (futures));
+	for (unsigned i = 0; i < futures.size(); i++) futures[i].onReady (boost::bind (gatherOne<T>, g, i));
+	return g->any.future();
+}
+
+}
@@ -0,0 +1,123 @@
+#include "hedge.h"
+#include "deadline.h"
+#include <map>
+#include <algorithm>
+#include <time.h>
+#include <unistd.h>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+static boost::detail::atomic_count calls (0), hedged (0), won (0), cancelled (0), turn (0), issued (0);
+
+static long long now () {
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/** Last microsecond latencies of first copies of a function's calls */
+struct Latencies {
+	static const unsigned Size = 256;
+	std::vector<long long> samples;
+	unsigned next;  // to overwrite once full
+	Latencies () : next(0) {}
+	void add (long long micros) {
+		if (samples.size() < Size) samples.push_back (micros);
+		else samples [next++ % Size] = micros;
+	}
+};
+
+static boost::mutex latenciesMutex;  // guards below
+static std::map < remote::FunctionId, Latencies > latencies;
+
+static void observe (const remote::FunctionId &fun, long long micros) {
+	boost::lock_guard<boost::mutex> lock (latenciesMutex);
+	latencies [fun] .add (micros);
+}
+
+/** Time to wait for first copy before sending second */
+static boost::posix_time::time_duration delay (const remote::FunctionId &fun, const hedge::Options &options) {
+	if (options.percentile == 0) return options.delay;
+	std::vector<long long> samples;
+	{
+		boost::lock_guard<boost::mutex> lock (latenciesMutex);
+		std::map < remote::FunctionId, Latencies >::iterator it = latencies.find (fun);
+		if (it == latencies.end() || it->second.samples.size() < hedge::MinSamples) return options.delay;
+		samples = it->second.samples;
+	}
+	size_t i = std::min ((size_t) (options.percentile * samples.size()), samples.size() - 1);
+	std::nth_element (samples.begin(), samples.begin() + i, samples.end());
+	return boost::posix_time::microseconds (samples[i]);
+}
+
+/** Cancel token unique to this call, see deadline.h. Mixes a counter with a random id of this process so servers do not confuse tokens of different clients */
+static boost::uint64_t newToken () {
+	static const boost::uint64_t instance = ((boost::uint64_t) now() << 20) ^ (boost::uint64_t) getpid();
+	boost::uint64_t z = instance + 0x9e3779b97f4a7c15ULL * (boost::uint64_t) ++issued; // splitmix64
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31)) | 1;
+}
+
+/** Tell host to stop running the copy with token. Best effort: its response is not awaited */
+static void cancel (remote::Host host, boost::uint64_t token) {
+	++cancelled;
+	try {call::send (remote::hostPort (host), deadline::cancelRequest (token));}
+	catch (std::exception &e) {} // copy ends on its own
+}
+
+io::Code remote::_evalHedged (Closure closure, std::vector<Host> hosts, hedge::Options options, executor::Priority priority) {
+	if (hosts.empty()) throw std::invalid_argument ("evalHedged on no hosts");
+	++calls;
+	unsigned first = (unsigned long) ++turn % hosts.size();
+	long long started[2] = {now(), 0};
+	if (hosts.size() == 1) {
+		io::Code result = _eval (closure, hosts[first], priority);
+		observe (closure.fun, now() - started[0]);
+		return result;
+	}
+	boost::uint64_t tokens[2] = {newToken(), newToken()}; // one per copy, so whichever loses can be cancelled
+	std::vector<Host> replicas;
+	replicas.push_back (hosts[first]);
+	replicas.push_back (hosts[(first + 1) % hosts.size()]);
+	std::vector< future::Future<io::Code> > copies;
+	{
+		deadline::Cancellable cancellable (tokens[0]);
+		copies.push_back (_evalAsync (closure, replicas[0], priority));
+	}
+	if (copies[0].wait (delay (closure.fun, options)) && !copies[0].hasError()) {
+		observe (closure.fun, now() - started[0]);
+		return copies[0].get();
+	}
+	++hedged;
+	started[1] = now();
+	{
+		deadline::Cancellable cancellable (tokens[1]);
+		copies.push_back (_evalAsync (closure, replicas[1], priority));
+	}
+	unsigned w = future::whenAny (copies) .get();
+	if (!copies[0].isReady() || !copies[0].hasError()) observe (closure.fun, now() - started[0]); // or at least this long, if still running
+	if (copies[w].hasError()) { // first to answer failed, wait for other
+		w = 1 - w;
+		copies[w].wait();
+		if (copies[w].hasError()) return copies[w].get(); // both failed, raise last error
+	}
+	if (w == 1) ++won; // only once it succeeded
+	if (!copies[1 - w].isReady()) cancel (replicas[1 - w], tokens[1 - w]);
+	return copies[w].get();
+}
+
+hedge::Stats hedge::stats () {
+	Stats s;
+	s.calls = calls;
+	s.hedged = hedged;
+	s.won = won;
+	s.cancelled = cancelled;
+	return s;
+}
+
+std::ostream& operator<< (std::ostream& out, const hedge::Stats &s) {
+	out << s.calls << " calls, " << s.hedged << " hedged (" << s.hedgeRate() * 100 << "%), " << s.won << " won by hedge (" << s.winRate() * 100 << "%), " << s.cancelled << " cancelled";
+	return out;
+}
@@ -0,0 +1,60 @@
+/* Hedged calls of read-only functions deployed on several replicas, to cut tail latency. A hedged call goes to one replica, and a second copy goes to the next replica if no response came within a delay, or at once if the first failed. The first success wins and the other copy is cancelled on its server (see deadline.h).
+ * The delay is fixed, or a percentile of the latencies observed of first copies of the function's calls, hedged or not, so only the slowest calls are hedged. Only hedge functions that are safe to run twice. */
+
+#pragma once
+
+#include <vector>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include "remote.h"
+
+namespace hedge {
+
+	struct Options {
+		boost::posix_time::time_duration delay;  // before sending second copy
+		double percentile;  // if not 0, delay is this percentile of observed latency of the function instead, eg. 0.95, once `MinSamples` calls were observed
+		Options (boost::posix_time::time_duration delay = boost::posix_time::milliseconds (10)) : delay(delay), percentile(0) {}
+	};
+
+	/** Latencies observed of a function before its percentile is used as delay */
+	const unsigned MinSamples = 16;
+
+	/** Snapshot of counters of this process */
+	struct Stats {
+		long calls;
+		long hedged;  // calls that sent a second copy
+		long won;  // hedged calls answered by their second copy first
+		long cancelled;  // copies cancelled after the other won
+		Stats () : calls(0), hedged(0), won(0), cancelled(0) {}
+		/** Share of calls hedged */
+		double hedgeRate () const {return calls == 0 ? 0 : (double) hedged / calls;}
+		/** Share of hedged calls won by their second copy */
+		double winRate () const {return hedged == 0 ? 0 : (double) won / hedged;}
+	};
+
+	Stats stats ();
+
+}
+
+namespace remote {
+
+	/** Evaluate closure on one of hosts, hedged, see hedge.h. Replicas take turns being sent the first copy */
+	io::Code _evalHedged (Closure, std::vector<Host>, hedge::Options, executor::Priority);
+
+	/** Same as `eval` on one of the replica hosts, sending a second copy to another if no response came within options' delay. Raise error of last copy if both failed */
+	template <class O> O evalHedged (Function0<O> action, std::vector<Host> hosts, hedge::Options options, executor::Priority priority = executor::Interactive) {
+		return io::decode<O> (_evalHedged (action.closure, hosts, options, priority));
+	}
+	template <> inline void evalHedged<void> (Function0<void> action, std::vector<Host> hosts, hedge::Options options, executor::Priority priority) {
+		_evalHedged (action.closure, hosts, options, priority);
+	}
+
+	/** Same as above with a fixed hedge delay */
+	template <class O> O evalHedged (Function0<O> action, std::vector<Host> hosts, boost::posix_time::time_duration hedgeDelay, executor::Priority priority = executor::Interactive) {
+		return evalHedged (action, hosts, hedge::Options (hedgeDelay), priority);
+	}
+
+}
+
+/* Printing */
+
+std::ostream& operator<< (std::ostream&, const hedge::Stats&);
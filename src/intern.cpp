@@ -0,0 +1,157 @@
+#include "intern.h"
+#include "memo.h"
+#include "metrics.h"
+#include "streaming.h"
+#include <map>
+#include <vector>
+#include <sstream>
+#include <unistd.h>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+bool intern::useHandles = true;
+
+/** "instance.index", instance in hex */
+static std::string showHandle (intern::Handle h) {
+	std::ostringstream out;
+	out << std::hex << h.instance << '.' << std::dec << h.index;
+	return out.str();
+}
+
+static intern::Handle parseHandle (const std::string &s) {
+	std::istringstream in (s);
+	intern::Handle h;
+	char dot = 0;
+	in >> std::hex >> h.instance >> dot >> std::dec >> h.index;
+	if (!in || dot != '.') throw std::runtime_error ("Corrupt function handle: " + s);
+	return h;
+}
+
+/* Server */
+
+/** Loaded function of a handle */
+struct Entry {
+	remote::FunctionId fun;
+	boost::function1 <io::Code, remote::Args> stub;
+	Entry (remote::FunctionId fun, boost::function1 <io::Code, remote::Args> stub) : fun(fun), stub(stub) {}
+};
+
+/** Random id of this process, so handles of a previous process on the same port are not mistaken for ours */
+static boost::uint64_t newInstance () {
+	boost::posix_time::ptime epoch (boost::gregorian::date (1970, 1, 1));
+	boost::uint64_t t = (boost::posix_time::microsec_clock::universal_time() - epoch) .total_microseconds();
+	return (t << 16) ^ (boost::uint64_t) getpid() ^ 1;
+}
+
+static const boost::uint64_t instance = newInstance ();
+static boost::shared_mutex tableMutex;  // guards below
+static std::vector < boost::shared_ptr<Entry> > table;  // indexed by handle index
+static std::map < remote::FunctionId, boost::uint32_t > indexes;
+
+intern::Handle intern::add (const remote::FunctionId &fun) {
+	{
+		boost::shared_lock<boost::shared_mutex> lock (tableMutex);
+		std::map < remote::FunctionId, boost::uint32_t >::iterator it = indexes.find (fun);
+		if (it != indexes.end()) return Handle (instance, it->second);
+	}
+	boost::shared_ptr<Entry> entry (new Entry (fun, _function::getFunction0c (fun))); // load stub outside lock
+	boost::unique_lock<boost::shared_mutex> lock (tableMutex);
+	std::map < remote::FunctionId, boost::uint32_t >::iterator it = indexes.find (fun);
+	if (it != indexes.end()) return Handle (instance, it->second); // added while we loaded
+	table.push_back (entry);
+	indexes [fun] = table.size() - 1;
+	return Handle (instance, table.size() - 1);
+}
+
+static boost::shared_ptr<Entry> lookup (intern::Handle h) {
+	boost::shared_lock<boost::shared_mutex> lock (tableMutex);
+	if (h.instance != instance || h.index >= table.size()) throw intern::UnknownHandle ("Unknown function handle " + showHandle (h));
+	return table [h.index];
+}
+
+static io::Code runStub (const Entry &entry, const remote::Args &args) {
+	try {
+		return entry.stub (args);
+	} catch (std::exception &e) {
+		std::cerr << entry.fun.funSig.funName << " : " << args << std::endl;
+		std::cerr << typeName(e) << ": " << e.what() << std::endl;
+		throw;
+	}
+}
+
+/** Run stub, or take its result from the memo cache if function is memoized (see memo.h). Stub decodes args, then marks its Execute and Encode phases */
+static io::Code run (const Entry &entry, const remote::Args &args) {
+	metrics::mark (metrics::Decode);
+	if (streaming::active()) return runStub (entry, args);
+	return memo::call (entry.fun, args, boost::bind (runStub, boost::cref (entry), boost::cref (args)));
+}
+
+/** Handle request is '@' handle '\n' encoded args. Request to intern is '#' encoded Closure, and its response is handle '\n' result. Anything else is an encoded Closure */
+io::Code intern::reply (io::Code request) {
+	metrics::Call call;
+	const std::string &data = request.data;
+	if (!data.empty() && data[0] == '@') {
+		size_t end = data.find ('\n');
+		if (end == std::string::npos) throw std::runtime_error ("Corrupt handle request");
+		metrics::mark (metrics::Lookup);
+		boost::shared_ptr<Entry> entry = lookup (parseHandle (data.substr (1, end - 1)));
+		call.function (entry->fun);
+		return run (*entry, io::decode<remote::Args> (io::Code (data.substr (end + 1))));
+	}
+	if (!data.empty() && data[0] == '#') {
+		remote::Closure closure = io::decode<remote::Closure> (io::Code (data.substr (1)));
+		call.function (closure.fun);
+		metrics::mark (metrics::Lookup);
+		Handle h = add (closure.fun);
+		io::Code result = run (*lookup (h), closure.args);
+		return io::Code (showHandle (h) + '\n' + result.data);
+	}
+	remote::Closure closure = io::decode<remote::Closure> (request);
+	call.function (closure.fun);
+	metrics::mark (metrics::Lookup);
+	return run (Entry (closure.fun, _function::getFunction0c (closure.fun)), closure.args);
+}
+
+/* Client */
+
+static boost::mutex handlesMutex;
+static std::map < network::HostPort, std::map <remote::FunctionId, intern::Handle> > handles;
+
+io::Code intern::request (network::HostPort hostPort, const remote::Closure &closure, bool &interning) {
+	interning = false;
+	if (!useHandles || !call::acceptsHandles (hostPort)) return io::encode (closure);
+	{
+		boost::lock_guard<boost::mutex> lock (handlesMutex);
+		std::map < network::HostPort, std::map <remote::FunctionId, Handle> >::iterator server = handles.find (hostPort);
+		if (server != handles.end()) {
+			std::map <remote::FunctionId, Handle>::iterator it = server->second.find (closure.fun);
+			if (it != server->second.end()) return io::Code ("@" + showHandle (it->second) + '\n' + io::encode (closure.args) .data);
+		}
+	}
+	interning = true;
+	return io::Code ("#" + io::encode (closure) .data);
+}
+
+io::Code intern::result (network::HostPort hostPort, const remote::FunctionId &fun, bool interning, io::Code response) {
+	if (!interning) return response;
+	size_t end = response.data.find ('\n');
+	if (end == std::string::npos) throw std::runtime_error ("Server did not return function handle");
+	Handle h = parseHandle (response.data.substr (0, end));
+	{
+		boost::lock_guard<boost::mutex> lock (handlesMutex);
+		handles [hostPort] [fun] = h;
+	}
+	return io::Code (response.data.substr (end + 1));
+}
+
+bool intern::isUnknown (const call::Exception &e) {
+	return e.errorType == typeName<UnknownHandle>();
+}
+
+void intern::forget (network::HostPort hostPort) {
+	boost::lock_guard<boost::mutex> lock (handlesMutex);
+	handles.erase (hostPort);
+}
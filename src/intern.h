@@ -0,0 +1,53 @@
+/* Compact handles for functions a server has already seen, so a call only sends its function's full FunctionId (module and signature) once per server instead of on every request.
+ * A client that has no handle for a function yet asks the server to intern it along with the call. The server adds the function to its table and replies the handle with the result. Later calls send the handle and args only, and the server finds the function's stub by indexing its table, without decoding or comparing FunctionIds.
+ * Clients only send handles to servers that granted them when the connection switched to frames (see frame.h), so older servers get full Closures.
+ * Handles include a random id of the server process, so handles given out by a server before it restarted are refused with UnknownHandle, and the client sends the full FunctionId again. */
+
+#pragma once
+
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+#include "function.h"
+#include "call.h"
+
+namespace intern {
+
+	/** Send handles instead of FunctionIds to servers. Default true */
+	extern bool useHandles;
+
+	struct Handle {
+		boost::uint64_t instance;  // of server process
+		boost::uint32_t index;  // into server's table
+		Handle (boost::uint64_t instance, boost::uint32_t index) : instance(instance), index(index) {}
+		Handle () : instance(0), index(0) {}
+	};
+
+	/** Raised by server given a handle it did not give out */
+	class UnknownHandle : public std::runtime_error {
+	public:
+		UnknownHandle (std::string message) : std::runtime_error (message) {}
+	};
+
+	/* Server */
+
+	/** Handle of function in this process's table, adding it (and loading its stub) if not there yet */
+	Handle add (const remote::FunctionId&);
+
+	/** Run request, which is an encoded Closure, a Closure to intern, or a handle with args (see `request`). Reply to a Closure to intern starts with its handle */
+	io::Code reply (io::Code request);
+
+	/* Client */
+
+	/** Request to run closure on server. Sets `interning` if it asks server for a handle, which `result` then expects in the response */
+	io::Code request (network::HostPort, const remote::Closure&, bool &interning);
+
+	/** Result of response to `request`, recording handle it carries if interning */
+	io::Code result (network::HostPort, const remote::FunctionId&, bool interning, io::Code response);
+
+	/** Whether exception raised by server is UnknownHandle, in which case the request may be sent again after `forget` (function did not run) */
+	bool isUnknown (const call::Exception&);
+
+	/** Drop handles of server, so the next request of each function asks for a new one */
+	void forget (network::HostPort);
+
+}
@@ -0,0 +1,102 @@
+#include "manifest.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <dlfcn.h>
+
+typedef boost::function1<io::Code,remote::Args> SerialFun;
+
+void manifest::write (std::string path, Manifest funs) {
+	std::ofstream out (path.c_str());
+	out << io::encode (funs);
+	if (!out) throw std::runtime_error ("Cannot write manifest " + path);
+}
+
+manifest::Manifest manifest::read (std::string path) {
+	std::ifstream in (path.c_str());
+	if (!in) throw std::runtime_error ("Cannot read manifest " + path);
+	io::Code code;
+	in >> code;
+	return io::decode<Manifest> (code);
+}
+
+static void append (std::vector<std::string> &xs, const std::vector<std::string> &ys, bool unique) {
+	for (unsigned i = 0; i < ys.size(); i++)
+		if (!unique || std::find (xs.begin(), xs.end(), ys[i]) == xs.end())
+			xs.push_back (ys[i]);
+}
+
+/** Link context of all stubs, stub i named serialArgsOutFun<i> */
+static compile::LinkContext context (const manifest::Manifest &funs) {
+	if (funs.empty()) throw std::runtime_error ("Empty manifest");
+	compile::LinkContext all = _function::defFunction0c (funs[0].module, "serialArgsOutFun0", funs[0].funSig);
+	for (unsigned i = 1; i < funs.size(); i++) {
+		compile::LinkContext ctx = _function::defFunction0c (funs[i].module, "serialArgsOutFun" + to_string (i), funs[i].funSig);
+		append (all.libPaths, ctx.libPaths, true);
+		append (all.includePaths, ctx.includePaths, true);
+		append (all.libNames, ctx.libNames, true);
+		append (all.headers, ctx.headers, false); // stub definitions are distinct; repeated includes are harmless
+	}
+	all.headers.push_back ("#include <boost/function.hpp>");
+	all.headers.push_back ("#include <boost/bind.hpp>");
+	return all;
+}
+
+/** Hash of manifest and its stubs' source embedded in its library, so a library is never used with a different manifest, nor with stubs generated differently by another version of this library */
+static std::string fingerprint (const manifest::Manifest &funs) {
+	compile::LinkContext ctx = context (funs);
+	std::string stubs;
+	for (unsigned i = 0; i < ctx.headers.size(); i++) stubs += ctx.headers[i];
+	return stubcache::hash (io::encode (funs) .data + stubs);
+}
+
+/** Exports `remote_stubs (i)` returning new stub i, and `remote_manifest ()` returning fingerprint of manifest */
+static std::string exports (const manifest::Manifest &funs) {
+	std::stringstream ss;
+	ss << "extern \"C\" const char* remote_manifest () {return \"" << fingerprint (funs) << "\";}\n";
+	ss << "extern \"C\" void* remote_stubs (unsigned i) {\n";
+	ss << "\tswitch (i) {\n";
+	for (unsigned i = 0; i < funs.size(); i++)
+		ss << "\tcase " << i << ": return new boost::function1<io::Code,remote::Args> (boost::bind (serialArgsOutFun" << i << ", _1));\n";
+	ss << "\tdefault: return 0;\n";
+	ss << "\t}\n";
+	ss << "}\n";
+	return ss.str();
+}
+
+std::string manifest::source (Manifest funs) {
+	compile::LinkContext ctx = context (funs);
+	std::stringstream ss;
+	for (unsigned i = 0; i < ctx.headers.size(); i++) ss << ctx.headers[i] << "\n";
+	ss << exports (funs);
+	return ss.str();
+}
+
+void manifest::build (std::string manifestPath, std::string libraryPath) {
+	Manifest funs = read (manifestPath);
+	stubcache::build (context (funs), source (funs), libraryPath);
+}
+
+/** Load stubs from library into cache0c, or return false if library is missing or was built from another manifest */
+static bool preloadLibrary (const manifest::Manifest &funs, std::string libraryPath) {
+	void* lib = dlopen (libraryPath.c_str(), RTLD_NOW | RTLD_GLOBAL);
+	if (!lib) return false;
+	const char* (*built) () = (const char* (*) ()) dlsym (lib, "remote_manifest");
+	void* (*stub) (unsigned) = (void* (*) (unsigned)) dlsym (lib, "remote_stubs");
+	if (!built || !stub || fingerprint (funs) != built()) {
+		std::cerr << "Ignoring stubs " << libraryPath << ": not built from this manifest" << std::endl;
+		dlclose (lib);
+		return false;
+	}
+	for (unsigned i = 0; i < funs.size(); i++)
+		_function::cache0c.insert (funs[i], boost::shared_ptr<SerialFun> (static_cast<SerialFun*> (stub (i))));
+	return true;
+}
+
+void manifest::preload (std::string manifestPath, std::string libraryPath) {
+	Manifest funs = read (manifestPath);
+	if (preloadLibrary (funs, libraryPath)) return;
+	for (unsigned i = 0; i < funs.size(); i++)
+		_function::getFunction0c (funs[i]);
+}
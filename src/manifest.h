@@ -0,0 +1,28 @@
+/* Ahead-of-time compilation of function stubs. A manifest lists the functions a server is expected to run. The `stubgen` tool compiles stubs for all of them into one shared library, which a server preloads before accepting connections so the first call of each function does not wait on the compiler. */
+
+#pragma once
+
+#include "function.h"
+
+namespace manifest {
+
+	typedef std::vector<remote::FunctionId> Manifest;
+
+	/** Save manifest to file, typically from a client program that knows its functions, eg. `manifest::write ("app.manifest", items (MFUN(example,get).closure.fun))` */
+	void write (std::string path, Manifest);
+
+	Manifest read (std::string path);
+
+	/** Default location of the stubs library compiled from manifest at path */
+	inline std::string library (std::string path) {return path + ".so";}
+
+	/** Source of one translation unit defining the stubs of all functions in manifest */
+	std::string source (Manifest);
+
+	/** Compile stubs of manifest at manifestPath into shared library at libraryPath */
+	void build (std::string manifestPath, std::string libraryPath);
+
+	/** Load stubs of manifest at manifestPath into the compiled-function cache. Stubs come from libraryPath if it was built from this manifest, otherwise each is compiled (or fetched from stubcache) now */
+	void preload (std::string manifestPath, std::string libraryPath);
+
+}
@@ -0,0 +1,167 @@
+#include "memo.h"
+#include <map>
+#include <list>
+#include <stdexcept>
+#include <time.h>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+size_t memo::maxBytes = 64 << 20;
+
+/** Memoized result. Key is its hash, args are kept to tell apart closures with the same hash */
+struct Memo {
+	remote::FunctionId fun;
+	std::string args;
+	io::Code result;
+	long long expires;  // monotonic microseconds, 0 if never
+	std::list<boost::uint64_t>::iterator used;  // position in lru
+	size_t size () const {return args.size() + result.data.size() + sizeof (Memo);}
+};
+
+static boost::mutex mutex;  // guards below
+static std::map < remote::FunctionId, unsigned > ttls;  // of memoized functions
+static std::map < remote::FunctionId, unsigned long > generations;  // of functions' memos, bumped by invalidate
+static std::map < boost::uint64_t, Memo > memos;
+static std::list<boost::uint64_t> lru;  // least recently used first
+static memo::Stats counters;
+
+static long long now () {
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/** 64-bit FNV-1a of function signature and encoded args. Functions of the same signature in different modules may share hashes, which `call` tells apart */
+static boost::uint64_t hash (const remote::FunctionId &fun, const std::string &args) {
+	boost::uint64_t h = 14695981039346656037ULL;
+	const std::string* parts[] = {&fun.funSig.funName, &fun.funSig.returnType, &args};
+	for (unsigned p = 0; p < 3; p++) {
+		for (size_t i = 0; i < parts[p]->size(); i++) {
+			h ^= (unsigned char) (*parts[p])[i];
+			h *= 1099511628211ULL;
+		}
+		h ^= 0xff; // separator
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/** Drop memo, under lock */
+static void drop (std::map < boost::uint64_t, Memo >::iterator it) {
+	counters.bytes -= it->second.size();
+	lru.erase (it->second.used);
+	memos.erase (it);
+}
+
+static void evict () {
+	while (counters.bytes > memo::maxBytes && !lru.empty()) {
+		drop (memos.find (lru.front()));
+		counters.evicted++;
+	}
+}
+
+void memo::enable (const remote::FunctionId &fun, unsigned ttl) {
+	boost::lock_guard<boost::mutex> lock (mutex);
+	ttls [fun] = ttl;
+}
+
+void memo::disable (const remote::FunctionId &fun) {
+	invalidate (fun);
+	boost::lock_guard<boost::mutex> lock (mutex);
+	ttls.erase (fun);
+}
+
+memo::Stats memo::stats () {
+	boost::lock_guard<boost::mutex> lock (mutex);
+	Stats s = counters;
+	s.entries = memos.size();
+	return s;
+}
+
+/** Concurrent misses on the same closure each run it; the last result stays, unless the function was invalidated while it ran */
+io::Code memo::call (const remote::FunctionId &fun, const remote::Args &args, boost::function0<io::Code> run) {
+	boost::uint64_t key;
+	unsigned ttl;
+	unsigned long generation;
+	{
+		boost::unique_lock<boost::mutex> lock (mutex);
+		std::map < remote::FunctionId, unsigned >::iterator t = ttls.find (fun);
+		if (t == ttls.end()) {
+			lock.unlock();
+			return run();
+		}
+		ttl = t->second;
+		key = hash (fun, args.buffer);
+		std::map < boost::uint64_t, Memo >::iterator it = memos.find (key);
+		if (it != memos.end() && it->second.expires != 0 && it->second.expires <= now()) {
+			drop (it);
+			counters.expired++;
+			it = memos.end();
+		}
+		if (it != memos.end() && it->second.fun == fun && it->second.args == args.buffer) {
+			lru.splice (lru.end(), lru, it->second.used);
+			counters.hits++;
+			return it->second.result;
+		}
+		counters.misses++;
+		generation = generations [fun];
+	}
+	io::Code result = run(); // exceptions are not memoized
+	boost::lock_guard<boost::mutex> lock (mutex);
+	if (ttls.find (fun) == ttls.end()) return result; // disabled while running
+	if (generations [fun] != generation) return result; // invalidated while running, result may be stale
+	std::map < boost::uint64_t, Memo >::iterator it = memos.find (key);
+	if (it != memos.end()) drop (it);
+	Memo &m = memos [key];
+	m.fun = fun;
+	m.args = args.buffer;
+	m.result = result;
+	m.expires = ttl == 0 ? 0 : now() + (long long) ttl * 1000000;
+	m.used = lru.insert (lru.end(), key);
+	counters.bytes += m.size();
+	evict ();
+	return result;
+}
+
+void memo::invalidate (const remote::Closure &closure) {
+	boost::lock_guard<boost::mutex> lock (mutex);
+	generations [closure.fun]++;
+	std::map < boost::uint64_t, Memo >::iterator it = memos.find (hash (closure.fun, closure.args.buffer));
+	if (it == memos.end() || it->second.fun != closure.fun || it->second.args != closure.args.buffer) return;
+	drop (it);
+	counters.invalidated++;
+}
+
+void memo::invalidate (const remote::FunctionId &fun) {
+	boost::lock_guard<boost::mutex> lock (mutex);
+	generations [fun]++;
+	for (std::map < boost::uint64_t, Memo >::iterator it = memos.begin(); it != memos.end(); )
+		if (it->second.fun == fun) {
+			drop (it++);
+			counters.invalidated++;
+		} else
+			++it;
+}
+
+/** Invalidation request is '!' followed by 'c' and encoded Closure, or 'f' and encoded FunctionId */
+bool memo::isInvalidation (const io::Code &request) {
+	return !request.data.empty() && request.data[0] == '!';
+}
+
+io::Code memo::reply (const io::Code &request) {
+	const std::string &data = request.data;
+	if (data.size() < 2) throw std::runtime_error ("Corrupt invalidation request");
+	if (data[1] == 'c') invalidate (io::decode<remote::Closure> (io::Code (data.substr (2))));
+	else if (data[1] == 'f') invalidate (io::decode<remote::FunctionId> (io::Code (data.substr (2))));
+	else throw std::runtime_error ("Corrupt invalidation request");
+	return io::Code();
+}
+
+io::Code memo::request (const remote::Closure &closure) {
+	return io::Code ("!c" + io::encode (closure) .data);
+}
+
+io::Code memo::request (const remote::FunctionId &fun) {
+	return io::Code ("!f" + io::encode (fun) .data);
+}
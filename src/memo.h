@@ -0,0 +1,62 @@
+/* Memoized results of pure remote functions on a server. A function opted in with `enable` runs once per distinct arguments; later calls with the same closure get the result it returned, until it expires, is evicted to keep the cache under `maxBytes`, or is invalidated.
+ * Results are keyed by a hash of the function and its encoded arguments, so calls naming the function by handle (see intern.h) share results with calls sending the whole closure. Streamed calls (see streaming.h) are never memoized. */
+
+#pragma once
+
+#include <string>
+#include <boost/function.hpp>
+#include "function.h"
+
+namespace memo {
+
+	/* Server */
+
+	/** Memoize results of fun, each for ttl seconds, or until evicted if ttl is 0 */
+	void enable (const remote::FunctionId &fun, unsigned ttl = 0);
+
+	/** Stop memoizing fun and drop its results */
+	void disable (const remote::FunctionId &fun);
+
+	/** Total size of memoized arguments and results, beyond which least recently used ones are evicted. Default 64MB */
+	extern size_t maxBytes;
+
+	/** Snapshot of counters of this process */
+	struct Stats {
+		long hits;  // calls answered from cache
+		long misses;  // calls of memoized functions that ran
+		long expired;  // results dropped past their ttl
+		long evicted;  // results dropped to stay under maxBytes
+		long invalidated;  // results dropped by `invalidate`
+		long entries;  // results held
+		size_t bytes;  // size of results held
+		Stats () : hits(0), misses(0), expired(0), evicted(0), invalidated(0), entries(0), bytes(0) {}
+		/** Share of calls of memoized functions answered from cache */
+		double hitRate () const {return hits + misses == 0 ? 0 : (double) hits / (hits + misses);}
+	};
+
+	Stats stats ();
+
+	/** Result of fun applied to args, from cache if fun is memoized and has it, else by calling run */
+	io::Code call (const remote::FunctionId &fun, const remote::Args &args, boost::function0<io::Code> run);
+
+	/** Drop memoized result of closure. Calls of its function running now do not memoize theirs */
+	void invalidate (const remote::Closure &closure);
+
+	/** Drop all memoized results of fun. Calls of it running now do not memoize theirs */
+	void invalidate (const remote::FunctionId &fun);
+
+	/** Whether request is an invalidation sent by a client (see below) */
+	bool isInvalidation (const io::Code &request);
+
+	/** Apply invalidation request. Response is empty */
+	io::Code reply (const io::Code &request);
+
+	/* Client */
+
+	/** Request dropping server's memoized result of closure */
+	io::Code request (const remote::Closure &closure);
+
+	/** Request dropping all server's memoized results of fun */
+	io::Code request (const remote::FunctionId &fun);
+
+}
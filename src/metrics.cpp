@@ -0,0 +1,227 @@
+#include "metrics.h"
+#include <map>
+#include <set>
+#include <exception>
+#include <time.h>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/tss.hpp>
+
+const char* metrics::phaseName (Phase p) {
+	static const char* names[] = {"decode", "lookup", "execute", "encode"};
+	return p < Phases ? names[p] : "?";
+}
+
+long long metrics::Histogram::count () const {
+	long long n = 0;
+	for (unsigned i = 0; i < Buckets; i++) n += counts[i];
+	return n;
+}
+
+long long metrics::Histogram::percentile (double p) const {
+	long long n = count(), seen = 0;
+	if (n == 0) return 0;
+	for (unsigned i = 0; i < Buckets; i++) {
+		seen += counts[i];
+		if (seen >= p * n) return i == 0 ? 1 : 1LL << i;
+	}
+	return 1LL << (Buckets - 1);
+}
+
+static long long now () {
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static unsigned bucket (long long micros) {
+	unsigned b = 0;
+	while (micros > 0 && b < metrics::Histogram::Buckets - 1) {
+		micros >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/** Counters of one function on one thread. Only that thread adds to them, so adds are uncontended; they are atomic so snapshots read whole values */
+struct Counters {
+	long long calls, errors;
+	metrics::Histogram phases [metrics::Phases];
+	Counters () : calls(0), errors(0) {}
+};
+
+static long long read (long long &x) {return __sync_fetch_and_add (&x, 0);}
+
+static void addTo (metrics::FunctionStats &s, Counters &c) {
+	s.calls += read (c.calls);
+	s.errors += read (c.errors);
+	for (unsigned p = 0; p < metrics::Phases; p++) {
+		for (unsigned i = 0; i < metrics::Histogram::Buckets; i++) s.phases[p].counts[i] += read (c.phases[p].counts[i]);
+		s.phases[p].total += read (c.phases[p].total);
+	}
+}
+
+/** Counters of one thread and the call it is timing */
+struct ThreadMetrics {
+	boost::mutex mutex;  // guards adding functions, against snapshots
+	std::map < remote::FunctionId, Counters > functions;
+	// call being timed, used by this thread only
+	bool inCall;
+	bool known;  // function of call
+	remote::FunctionId fun;
+	metrics::Phase phase;
+	long long since;  // start of phase
+	long long spent [metrics::Phases];
+	ThreadMetrics () : inCall(false), known(false) {}
+};
+
+static boost::mutex threadsMutex;  // guards below
+static std::set < boost::shared_ptr<ThreadMetrics> > threads;
+static std::map < remote::FunctionId, metrics::FunctionStats > retired;  // counters of threads that exited
+
+/** Moves thread's counters to retired when it exits */
+struct ThreadHolder {
+	boost::shared_ptr<ThreadMetrics> metrics;
+	ThreadHolder () : metrics (new ThreadMetrics) {
+		boost::lock_guard<boost::mutex> lock (threadsMutex);
+		threads.insert (metrics);
+	}
+	~ThreadHolder () {
+		boost::lock_guard<boost::mutex> lock (threadsMutex);
+		for (std::map < remote::FunctionId, Counters >::iterator it = metrics->functions.begin(); it != metrics->functions.end(); ++it) {
+			std::map < remote::FunctionId, metrics::FunctionStats >::iterator r = retired.insert (std::make_pair (it->first, metrics::FunctionStats (it->first))) .first;
+			addTo (r->second, it->second);
+		}
+		threads.erase (metrics);
+	}
+};
+
+static boost::thread_specific_ptr<ThreadHolder> holder;
+
+static ThreadMetrics& thisThread () {
+	if (!holder.get()) holder.reset (new ThreadHolder);
+	return *holder->metrics;
+}
+
+metrics::Call::Call () {
+	ThreadMetrics &t = thisThread();
+	outer = !t.inCall;
+	if (!outer) return;
+	t.inCall = true;
+	t.known = false;
+	t.phase = Decode;
+	t.since = now();
+	for (unsigned p = 0; p < Phases; p++) t.spent[p] = 0;
+}
+
+void metrics::Call::function (const remote::FunctionId &fun) {
+	if (!outer) return;
+	ThreadMetrics &t = thisThread();
+	t.fun = fun;
+	t.known = true;
+}
+
+metrics::Call::~Call () {
+	if (!outer) return;
+	ThreadMetrics &t = thisThread();
+	t.inCall = false;
+	if (!t.known) return;
+	t.spent[t.phase] += now() - t.since;
+	std::map < remote::FunctionId, Counters >::iterator it = t.functions.find (t.fun); // only this thread adds, so no lock to look
+	if (it == t.functions.end()) {
+		boost::lock_guard<boost::mutex> lock (t.mutex);
+		it = t.functions.insert (std::make_pair (t.fun, Counters())) .first;
+	}
+	Counters &c = it->second;
+	__sync_fetch_and_add (&c.calls, 1);
+	if (std::uncaught_exception()) __sync_fetch_and_add (&c.errors, 1);
+	for (unsigned p = 0; p < Phases; p++) {
+		__sync_fetch_and_add (&c.phases[p].counts [bucket (t.spent[p])], 1);
+		__sync_fetch_and_add (&c.phases[p].total, t.spent[p]);
+	}
+}
+
+bool metrics::lastCall (std::string &funName, long long spent [Phases]) {
+	ThreadMetrics &t = thisThread();
+	if (t.inCall || !t.known) return false;
+	funName = t.fun.funSig.funName;
+	for (unsigned p = 0; p < Phases; p++) spent[p] = t.spent[p];
+	t.known = false;
+	return true;
+}
+
+void metrics::mark (Phase phase) {
+	ThreadMetrics &t = thisThread();
+	if (!t.inCall) return;
+	long long n = now();
+	t.spent[t.phase] += n - t.since;
+	t.phase = phase;
+	t.since = n;
+}
+
+static long long accepted = 0, open = 0, queued = 0, running = 0;
+
+void metrics::opened () {
+	__sync_fetch_and_add (&accepted, 1);
+	__sync_fetch_and_add (&open, 1);
+}
+
+void metrics::closed () {
+	__sync_fetch_and_sub (&open, 1);
+}
+
+void metrics::queued (long n) {
+	__sync_fetch_and_add (&::queued, n);
+}
+
+metrics::Running::Running () {
+	__sync_fetch_and_add (&running, 1);
+}
+
+metrics::Running::~Running () {
+	__sync_fetch_and_sub (&running, 1);
+}
+
+metrics::Snapshot metrics::snapshot () {
+	std::map < remote::FunctionId, FunctionStats > all;
+	{
+		boost::lock_guard<boost::mutex> lock (threadsMutex);
+		all = retired;
+		for (std::set < boost::shared_ptr<ThreadMetrics> >::iterator t = threads.begin(); t != threads.end(); ++t) {
+			boost::lock_guard<boost::mutex> lock ((*t)->mutex);
+			for (std::map < remote::FunctionId, Counters >::iterator it = (*t)->functions.begin(); it != (*t)->functions.end(); ++it)
+				addTo (all.insert (std::make_pair (it->first, FunctionStats (it->first))) .first->second, it->second);
+		}
+	}
+	Snapshot s;
+	for (std::map < remote::FunctionId, FunctionStats >::iterator it = all.begin(); it != all.end(); ++it) s.functions.push_back (it->second);
+	s.server.accepted = read (accepted);
+	s.server.open = read (open);
+	s.server.queued = read (::queued);
+	s.server.running = read (running);
+	return s;
+}
+
+bool metrics::isStatsRequest (const io::Code &request) {
+	return request.data == "?stats";
+}
+
+io::Code metrics::reply (const io::Code &request) {
+	return io::encode (snapshot());
+}
+
+io::Code metrics::request () {
+	return io::Code ("?stats");
+}
+
+std::ostream& operator<< (std::ostream& out, const metrics::Snapshot &s) {
+	out << "connections " << s.server.open << " open, " << s.server.accepted << " accepted; requests " << s.server.running << " running, " << s.server.queued << " queued" << std::endl;
+	for (unsigned i = 0; i < s.functions.size(); i++) {
+		const metrics::FunctionStats &f = s.functions[i];
+		out << f.fun.funSig.funName << ": " << f.calls << " calls, " << f.errors << " errors";
+		for (unsigned p = 0; p < metrics::Phases; p++)
+			out << "; " << metrics::phaseName ((metrics::Phase) p) << " mean " << f.phases[p].mean() << "us p99 " << f.phases[p].percentile (0.99) << "us";
+		out << std::endl;
+	}
+	return out;
+}
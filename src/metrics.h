@@ -0,0 +1,118 @@
+/* Call counts and latencies of each remote function run by this process, and load of its servers. Always on: each thread records into its own counters without locks, which a snapshot sums.
+ * A call's time is split into phases: decoding its request and arguments, looking up (or compiling) its stub, executing the function, and encoding its result. A server answers `remote::stats (host)` with its snapshot. */
+
+#pragma once
+
+#include <vector>
+#include <boost/serialization/vector.hpp>
+#include "function.h"
+#include "phase.h"
+
+namespace metrics {
+
+	/** Counts of durations by power of two microseconds: bucket 0 is under 1us, bucket i is [2^(i-1), 2^i) us */
+	struct Histogram {
+		static const unsigned Buckets = 32;
+		long long counts [Buckets];
+		long long total;  // microseconds
+		Histogram () : total(0) {for (unsigned i = 0; i < Buckets; i++) counts[i] = 0;}
+		long long count () const;
+		/** Upper bound in microseconds of fraction p of durations, eg. 0.99 */
+		long long percentile (double p) const;
+		double mean () const {return count() == 0 ? 0 : (double) total / count();}
+	};
+
+	struct FunctionStats {
+		remote::FunctionId fun;
+		long long calls;
+		long long errors;  // calls that raised an exception
+		Histogram phases [Phases];
+		FunctionStats (remote::FunctionId fun) : fun(fun), calls(0), errors(0) {}
+		FunctionStats () : calls(0), errors(0) {} // for serialization
+	};
+
+	struct ServerStats {
+		long long accepted;  // connections
+		long long open;  // connections
+		long long queued;  // requests read but not yet running
+		long long running;  // requests
+		ServerStats () : accepted(0), open(0), queued(0), running(0) {}
+	};
+
+	struct Snapshot {
+		std::vector<FunctionStats> functions;
+		ServerStats server;
+	};
+
+	Snapshot snapshot ();
+
+	/** Times phases of a call on this thread while in scope, starting in Decode. Recorded against its function once known, as an error if left by an exception */
+	class Call {
+		bool outer;  // false if nested in another call on this thread, which times both
+		Call (const Call&);  // not copyable
+		void operator= (const Call&);
+	public:
+		Call ();
+		~Call ();
+		void function (const remote::FunctionId &);
+	};
+
+	/** Name of function and microseconds spent in each phase of the last call timed on this thread, since last asked. False if there was none or its function was never known */
+	bool lastCall (std::string &funName, long long spent [Phases]);
+
+	/* Server load, kept by call::listen and call::serve */
+
+	void opened ();
+	void closed ();
+	/** Change number of requests waiting by n */
+	void queued (long n);
+
+	/** Counts a running request while in scope */
+	class Running {
+	public:
+		Running ();
+		~Running ();
+	};
+
+	/** Whether request asks for this process's snapshot */
+	bool isStatsRequest (const io::Code &request);
+
+	/** Snapshot encoded */
+	io::Code reply (const io::Code &request);
+
+	/** Request for a server's snapshot */
+	io::Code request ();
+
+}
+
+/* Printing & Serialization */
+
+std::ostream& operator<< (std::ostream&, const metrics::Snapshot&);
+
+namespace boost {namespace serialization {
+
+template <class Archive> void serialize (Archive & ar, metrics::Histogram & x, const unsigned version) {
+	ar & x.counts;
+	ar & x.total;
+}
+
+template <class Archive> void serialize (Archive & ar, metrics::FunctionStats & x, const unsigned version) {
+	ar & x.fun;
+	ar & x.calls;
+	ar & x.errors;
+	ar & x.phases;
+}
+
+template <class Archive> void serialize (Archive & ar, metrics::ServerStats & x, const unsigned version) {
+	ar & x.accepted;
+	ar & x.open;
+	ar & x.queued;
+	ar & x.running;
+}
+
+template <class Archive> void serialize (Archive & ar, metrics::Snapshot & x, const unsigned version) {
+	ar & x.functions;
+	ar & x.server;
+}
+
+}}
@@ -0,0 +1,15 @@
+/* Phases of a remote call timed by metrics.h. Kept apart from it so compiled stubs, which mark where they pass from decoding to executing to encoding, include no more than this. */
+
+#pragma once
+
+namespace metrics {
+
+	enum Phase {Decode, Lookup, Execute, Encode, Phases};
+
+	/** Name of phase */
+	const char* phaseName (Phase);
+
+	/** End current phase of call on this thread, if any, and start given phase */
+	void mark (Phase);
+
+}
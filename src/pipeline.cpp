@@ -0,0 +1,56 @@
+#include "pipeline.h"
+#include "remote.h"
+#include "intern.h"
+#include "trace.h"
+#include "deadline.h"
+#include <stdexcept>
+#include <10util/util.h> // to_string
+
+/** Pipeline request is '|', priority digit, then encoded Stages */
+bool pipeline::isRequest (const io::Code &request) {
+	return !request.data.empty() && request.data[0] == '|';
+}
+
+io::Code pipeline::request (const Stages &stages, executor::Priority priority) {
+	return io::Code ("|" + to_string ((unsigned) priority) + io::encode (stages) .data);
+}
+
+/** Whether host names this server, so its stage needs no hop */
+static bool isHere (const std::string &host) {
+	try {
+		network::HostPort a = remote::hostPort (host), b = remote::hostPort (remote::thisHost());
+		return a.hostname == b.hostname && a.port == b.port;
+	} catch (std::exception &e) {
+		return false; // not listening
+	}
+}
+
+/** Send stages from i on to their host, the first already bound to its argument */
+static io::Code forward (const pipeline::Stages &stages, unsigned i, executor::Priority priority) {
+	pipeline::Stages rest (stages.begin() + i, stages.end());
+	trace::Client span (rest[0].closure.fun.funSig.funName, rest[0].host);
+	try {
+		io::Code result = call::call (remote::hostPort (rest[0].host), deadline::request (span.request (pipeline::request (rest, priority))), priority);
+		span.finish (false);
+		return result;
+	} catch (std::exception &e) {
+		span.finish (true);
+		throw;
+	}
+}
+
+io::Code pipeline::reply (const io::Code &request) {
+	if (request.data.size() < 2 || request.data[1] < '0' || request.data[1] > '1') throw std::runtime_error ("Corrupt pipeline request");
+	executor::Priority priority = (executor::Priority) (request.data[1] - '0');
+	Stages stages = io::decode<Stages> (io::Code (request.data.substr (2)));
+	if (stages.empty()) throw std::runtime_error ("Empty pipeline");
+	io::Code result;
+	for (unsigned i = 0; i < stages.size(); i++) {
+		if (i > 0) {
+			stages[i].closure.args.push_back (result); // results are encoded the same as args
+			if (!stages[i].host.empty() && !isHere (stages[i].host)) return forward (stages, i, priority);
+		}
+		result = intern::reply (io::encode (stages[i].closure));
+	}
+	return result;
+}
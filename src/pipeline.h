@@ -0,0 +1,48 @@
+/* Pipelines of remote functions evaluated on servers end to end. A pipeline is a first action followed by functions of one argument, each applied to the result of the stage before it. It is sent as one request: the server runs stages in turn, feeding each result into the next closure still encoded, and forwards the rest of the pipeline (with the intermediate result bound) straight to the host of the first stage naming another host. Only the final result comes back to the caller.
+ * A stage with no host runs where the stage before it ran. See `remote::Pipeline` for the typed interface. */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+#include "function.h"
+#include "executor.h"
+
+namespace pipeline {
+
+	struct Stage {
+		remote::Closure closure;  // all args bound but the previous stage's result, or all of them for the first stage
+		std::string host;  // to run on, or empty to run where the previous stage ran
+		Stage (remote::Closure closure, std::string host) : closure(closure), host(host) {}
+		Stage () {} // for serialization
+	};
+
+	typedef std::vector<Stage> Stages;
+
+	/* Server */
+
+	/** Whether request is a pipeline (see `request`) */
+	bool isRequest (const io::Code &request);
+
+	/** Run stages of pipeline request here until one names another host, then forward the rest there. Result of last stage encoded */
+	io::Code reply (const io::Code &request);
+
+	/* Client */
+
+	/** Request running stages, the first on the server it is sent to */
+	io::Code request (const Stages &stages, executor::Priority priority);
+
+}
+
+/* Serialization */
+
+namespace boost {namespace serialization {
+
+template <class Archive> void serialize (Archive & ar, pipeline::Stage & x, const unsigned version) {
+	ar & x.closure;
+	ar & x.host;
+}
+
+}}
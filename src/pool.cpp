@@ -0,0 +1,221 @@
+#include "pool.h"
+#include "frame.h"
+#include "deadline.h"
+#include <map>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+pool::Options::Options () : minConnections (0), maxConnections (16), idleTimeout (60), probeInterval (15), probeTimeout (5), retries (1) {}
+
+pool::Options pool::options;
+
+using boost::posix_time::ptime;
+
+static ptime now () {return boost::posix_time::microsec_clock::universal_time();}
+
+struct PooledConnection {
+	io::IOStream stream;
+	bool framed;
+	ptime used;  // last returned by a call
+	ptime probed;  // last known to be alive
+};
+
+/** Connections to one server */
+struct Pool {
+	std::vector<PooledConnection> idle;  // most recently returned last
+	unsigned open;  // idle or lent out
+	boost::condition_variable returned;
+	Pool () : open(0) {}
+};
+
+static boost::mutex mutex;  // guards servers and their contents
+static std::map < network::HostPort, boost::shared_ptr<Pool> > servers;
+static boost::detail::atomic_count opened (0), reused (0), broken (0), retried (0);
+static boost::once_flag started = BOOST_ONCE_INIT;
+
+/** Pool of server, created on first use. Caller must hold mutex */
+static Pool& server (network::HostPort hostPort) {
+	boost::shared_ptr<Pool> &s = servers [hostPort];
+	if (!s) s.reset (new Pool);
+	return *s;
+}
+
+static PooledConnection openConnection (network::HostPort hostPort) {
+	PooledConnection c;
+	c.stream = call::connect (hostPort);
+	c.framed = call::framed (c.stream);
+	c.used = c.probed = now();
+	++opened;
+	return c;
+}
+
+/** Return connection to pool, or forget it (closing it) if it is broken */
+static void release (network::HostPort hostPort, PooledConnection c, bool ok) {
+	boost::lock_guard<boost::mutex> lock (mutex);
+	Pool &s = server (hostPort);
+	if (ok) s.idle.push_back (c);
+	else {
+		s.open--;
+		++broken;
+	}
+	s.returned.notify_one();
+}
+
+/** Give up on a connection that failed to open */
+static void cancel (network::HostPort hostPort) {
+	boost::lock_guard<boost::mutex> lock (mutex);
+	Pool &s = server (hostPort);
+	s.open--;
+	s.returned.notify_one();
+}
+
+/** Whether server answers a Ping on connection within options.probeTimeout */
+static bool ping (PooledConnection &c) {
+	try {
+		call::expiresIn (c.stream, pool::options.probeTimeout * 1000000LL);
+		frame::write (*c.stream, frame::Ping, 0, 0, "");
+		c.stream->flush();
+		frame::Header header;
+		std::string body;
+		bool ok = frame::read (*c.stream, header, body) && header.type == frame::Ping;
+		call::expiresIn (c.stream, 0);
+		return ok && *c.stream;
+	} catch (std::exception &e) {
+		return false;
+	}
+}
+
+/** Close connections idle too long, probe the rest, and open more up to the minimum */
+static void maintain (network::HostPort hostPort) {
+	std::vector<PooledConnection> probe;
+	unsigned missing = 0;
+	{
+		boost::lock_guard<boost::mutex> lock (mutex);
+		Pool &s = server (hostPort);
+		ptime t = now();
+		std::vector<PooledConnection> keep;
+		for (unsigned i = 0; i < s.idle.size(); i++) {
+			PooledConnection &c = s.idle[i];
+			if (t - c.used > boost::posix_time::seconds (pool::options.idleTimeout) && s.open > pool::options.minConnections) s.open--;
+			else if (c.framed && t - c.probed > boost::posix_time::seconds (pool::options.probeInterval)) probe.push_back (c); // lent to the probe
+			else keep.push_back (c);
+		}
+		s.idle.swap (keep);
+		if (s.open < pool::options.minConnections) {
+			missing = pool::options.minConnections - s.open;
+			s.open += missing;
+		}
+	}
+	for (unsigned i = 0; i < probe.size(); i++) {
+		bool ok = ping (probe[i]);
+		probe[i].probed = now();
+		release (hostPort, probe[i], ok);
+	}
+	for (unsigned i = 0; i < missing; i++) {
+		try {
+			release (hostPort, openConnection (hostPort), true);
+		} catch (std::exception &e) {
+			cancel (hostPort);
+		}
+	}
+}
+
+static void maintainAll () {
+	for (;;) {
+		boost::this_thread::sleep (boost::posix_time::seconds (1));
+		std::vector<network::HostPort> hostPorts;
+		{
+			boost::lock_guard<boost::mutex> lock (mutex);
+			for (std::map < network::HostPort, boost::shared_ptr<Pool> >::iterator it = servers.begin(); it != servers.end(); ++it)
+				hostPorts.push_back (it->first);
+		}
+		for (unsigned i = 0; i < hostPorts.size(); i++) maintain (hostPorts[i]);
+	}
+}
+
+static void start () {
+	boost::thread _th (maintainAll);
+}
+
+/** Most recently returned idle connection to server (which is the most likely to still be alive), or a new one if none is idle. Wait if server has maxConnections open already */
+static PooledConnection acquire (network::HostPort hostPort) {
+	boost::call_once (start, started);
+	{
+		boost::unique_lock<boost::mutex> lock (mutex);
+		Pool &s = server (hostPort);
+		while (s.idle.empty() && s.open >= std::max (1u, pool::options.maxConnections)) {
+			if (!deadline::active()) s.returned.wait (lock);
+			else if (deadline::remaining() <= 0) throw call::Timeout ("Deadline passed waiting for a connection to " + hostPort.hostname);
+			else s.returned.timed_wait (lock, boost::posix_time::microseconds (deadline::remaining()));
+		}
+		if (!s.idle.empty()) {
+			PooledConnection c = s.idle.back();
+			s.idle.pop_back();
+			++reused;
+			return c;
+		}
+		s.open++;
+	}
+	try {
+		return openConnection (hostPort);
+	} catch (std::exception &e) {
+		cancel (hostPort);
+		throw;
+	}
+}
+
+/** Under a deadline, wait for response until slack past it, after which the connection expires and is dropped */
+static call::Response callBefore (PooledConnection &c, call::Request request, executor::Priority priority) {
+	if (!deadline::active()) return call::call (c.stream, request, priority);
+	call::expiresIn (c.stream, std::max (deadline::remaining(), 0LL) + deadline::slack * 1000LL);
+	call::Response response = call::call (c.stream, request, priority);
+	call::expiresIn (c.stream, 0);
+	return response;
+}
+
+call::Response pool::call (network::HostPort hostPort, call::Request request, executor::Priority priority, bool idempotent) {
+	for (unsigned attempt = 0;; attempt++) {
+		PooledConnection c = acquire (hostPort);
+		try {
+			call::Response response = callBefore (c, request, priority);
+			if (! *c.stream) throw std::runtime_error ("PooledConnection to " + hostPort.hostname + " lost");
+			c.used = c.probed = now();
+			release (hostPort, c, true);
+			return response;
+		} catch (call::Exception &e) { // raised by server, connection is fine
+			if (deadline::active()) call::expiresIn (c.stream, 0);
+			c.used = c.probed = now();
+			release (hostPort, c, true);
+			throw;
+		} catch (std::exception &e) {
+			release (hostPort, c, false);
+			if (deadline::active() && deadline::remaining() <= 0) throw call::Timeout ("No response from " + hostPort.hostname + " by deadline");
+			if (!idempotent || attempt >= pool::options.retries) throw;
+			++retried;
+		}
+	}
+}
+
+pool::Stats pool::stats () {
+	Stats s;
+	s.opened = opened;
+	s.reused = reused;
+	s.broken = broken;
+	s.retried = retried;
+	return s;
+}
+
+void pool::clear () {
+	boost::lock_guard<boost::mutex> lock (mutex);
+	for (std::map < network::HostPort, boost::shared_ptr<Pool> >::iterator it = servers.begin(); it != servers.end(); ++it) {
+		it->second->open -= it->second->idle.size();
+		it->second->idle.clear();
+	}
+}
+
+call::Response call::call (network::HostPort hostPort, Request request, executor::Priority priority) {
+	return pool::call (hostPort, request, priority);
+}
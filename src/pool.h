@@ -0,0 +1,40 @@
+/* Process-wide pool of client connections per server, shared by all client threads, so many threads calling a few servers keep a few warm connections open instead of one per thread per server.
+ * A background thread closes connections idle for too long (beyond a minimum kept per server), opens connections up to that minimum, and probes idle framed connections with Ping frames (see frame.h) so a dead connection is dropped before a call tries it rather than after. */
+
+#pragma once
+
+#include "call.h"
+
+namespace pool {
+
+	struct Options {
+		unsigned minConnections;  // kept open to each server once used, even when idle. Default 0
+		unsigned maxConnections;  // open to each server at once. Callers wait for one to be returned beyond this. Default 16
+		unsigned idleTimeout;  // seconds after which an idle connection beyond minConnections is closed. Default 60
+		unsigned probeInterval;  // seconds between health probes of an idle connection. Default 15
+		unsigned probeTimeout;  // seconds a probed connection has to answer before it is dropped. Default 5
+		unsigned retries;  // times an idempotent call is retried on another connection after its connection fails. Default 1
+		Options ();
+	};
+
+	/** Options of all pools. Set before first call */
+	extern Options options;
+
+	/** Snapshot of counters of all pools */
+	struct Stats {
+		long opened;  // connections opened
+		long reused;  // calls served by an already open connection
+		long broken;  // connections dropped after a failed call or probe
+		long retried;  // idempotent calls retried on another connection
+		Stats () : opened(0), reused(0), broken(0), retried(0) {}
+	};
+
+	Stats stats ();
+
+	/** Send request to server over a pooled connection and wait for response. If the connection fails (not if server raises an exception) and request is idempotent, send it again over another connection, up to options.retries times. Thread safe. `remote::evalIdempotent` calls this with idempotent set */
+	call::Response call (network::HostPort, call::Request, executor::Priority = executor::Interactive, bool idempotent = false);
+
+	/** Close all idle connections */
+	void clear ();
+
+}
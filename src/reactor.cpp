@@ -0,0 +1,500 @@
+#include "reactor.h"
+#include "compression.h"
+#include "streaming.h"
+#include "frame.h"
+#include "metrics.h"
+#include "trace.h"
+#include "deadline.h"
+#include <set>
+#include <deque>
+#include <map>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <10util/either.h>
+#include <10util/util.h> // to_string
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <time.h>
+
+call::ServerOptions::ServerOptions () : workers (std::max (1u, boost::thread::hardware_concurrency())), interactiveWorkers (1), queueDepth (1024), maxPending (64), writeTimeout (30) {}
+
+static void check (int result, std::string what) {
+	if (result < 0) throw std::runtime_error (what + ": " + strerror (errno));
+}
+
+/** Listening socket on tcp port of all interfaces */
+static int tcpListener (network::Port port) {
+	int listener;
+	check (listener = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), "socket");
+	int one = 1;
+	setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	struct sockaddr_in addr;
+	memset (&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl (INADDR_ANY);
+	addr.sin_port = htons (port);
+	check (bind (listener, (struct sockaddr*) &addr, sizeof addr), "bind port " + to_string (port));
+	return listener;
+}
+
+/** Listening Unix domain socket at path, replacing any left by a previous server (see call::claimLocal) */
+static int localListener (std::string path) {
+	struct sockaddr_un addr;
+	memset (&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof addr.sun_path) throw std::runtime_error ("Socket path too long: " + path);
+	strcpy (addr.sun_path, path.c_str());
+	int listener;
+	call::claimLocal (path);
+	check (listener = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), "socket");
+	check (bind (listener, (struct sockaddr*) &addr, sizeof addr), "bind " + path);
+	return listener;
+}
+
+struct Connection;
+
+/** Request read from a connection */
+struct Task {
+	boost::shared_ptr<Connection> connection;
+	bool framed;
+	bool ordered;  // must not run before earlier ordered requests of its connection have been answered
+	executor::Priority priority;
+	bool compressed;  // request body, unpacked by worker
+	bool streamed;  // answered in chunks as produced
+	boost::uint32_t id;
+	long long parsed;  // monotonic microseconds, for time spent queued
+	call::Request request;
+	Task (boost::shared_ptr<Connection> connection, bool framed, boost::uint8_t flags, boost::uint32_t id) : connection(connection), framed(framed),
+		ordered (!(flags & (frame::Concurrent | frame::Streamed))), priority (flags & frame::Bulk ? executor::Bulk : executor::Interactive),
+		compressed (flags & frame::Compressed), streamed (flags & frame::Streamed), id(id), parsed (now()) {}
+	static long long now () {
+		struct timespec t;
+		clock_gettime (CLOCK_MONOTONIC, &t);
+		return (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+	}
+};
+
+struct Connection {
+	int fd;
+	// used by reactor thread only
+	bool framed;
+	bool compress;  // large frame bodies, see compression.h
+	unsigned events;  // registered with epoll
+	std::string refused;  // client speaks another protocol version, see frame.h
+	std::string input;  // read but not yet parsed
+	std::deque<Task> waiting;  // parsed but not yet given to workers
+	// shared with workers
+	boost::mutex mutex;  // guards below and writes to fd
+	bool busy;  // an ordered request is queued or running
+	std::string output;  // not yet taken by the socket, written by the reactor when it has room
+	long long progress;  // monotonic microseconds output last shrank, or was queued
+	bool broken;  // write failed, client gone
+	streaming::Registry streams;  // credits of running streamed requests
+	Connection (int fd) : fd(fd), framed(false), compress(false), events(EPOLLIN), busy(false), progress(0), broken(false) {}
+	~Connection () {close (fd);}
+};
+
+/** Read-only stream buffer over bytes held elsewhere, so parsing them does not copy them first */
+struct InputView : std::streambuf {
+	InputView (const char *begin, const char *end) {setg (const_cast<char*> (begin), const_cast<char*> (begin), const_cast<char*> (end));}
+	size_t consumed () const {return gptr() - eback();}
+};
+
+/** Bytes the non-blocking socket of c takes now, without waiting. Caller holds c.mutex */
+static size_t writeSome (Connection &c, const char *bytes, size_t size) {
+	size_t sent = 0;
+	while (sent < size) {
+		ssize_t n = ::send (c.fd, bytes + sent, size - sent, MSG_NOSIGNAL);
+		if (n >= 0) {sent += n; continue;}
+		if (errno == EINTR) continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) c.broken = true;
+		break;
+	}
+	return sent;
+}
+
+/** Write bytes after output queued before them, as far as the socket takes them now, and queue the rest for the reactor. Caller holds c.mutex. Throw if client is gone */
+static void queueOutput (Connection &c, const std::string &bytes) {
+	if (c.broken) throw std::runtime_error ("Client gone");
+	size_t sent = c.output.empty() ? writeSome (c, bytes.data(), bytes.size()) : 0;
+	if (c.broken) throw std::runtime_error ("Client gone");
+	if (sent == bytes.size()) return;
+	if (c.output.empty()) c.progress = Task::now();
+	c.output.append (bytes, sent, std::string::npos);
+}
+
+/** Write queued output as far as the socket takes it. Caller holds c.mutex */
+static void flushOutput (Connection &c) {
+	size_t sent = writeSome (c, c.output.data(), c.output.size());
+	if (c.broken) c.output.clear();
+	else if (sent > 0) {
+		c.output.erase (0, sent);
+		c.progress = Task::now();
+	}
+}
+
+/** Bytes of output queued on a connection beyond which it is not read */
+static const size_t MaxOutput = 1 << 20;
+
+class Reactor {
+	boost::function1 <call::Response, call::Request> respond;
+	call::ServerOptions options;
+	std::vector<int> listeners;  // tcp and/or Unix domain sockets
+	int epoll, wakeFd;
+	boost::scoped_ptr<executor::Executor> workers;
+	// reactor thread only
+	std::map < int, boost::shared_ptr<Connection> > connections;
+	std::set < boost::shared_ptr<Connection> > stalled;  // have waiting requests but the queue was full
+	std::set < boost::shared_ptr<Connection> > writing;  // have output queued
+	// shared with workers
+	boost::mutex wokenMutex;
+	std::vector < boost::shared_ptr<Connection> > woken;  // finished a request, may have more to run
+
+	void watch (int fd, unsigned events, int op) {
+		struct epoll_event e;
+		memset (&e, 0, sizeof e);
+		e.events = events;
+		e.data.fd = fd;
+		check (epoll_ctl (epoll, op, fd, &e), "epoll_ctl");
+	}
+
+	void acceptAll (int listener) {
+		for (;;) {
+			int fd = accept4 (listener, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0) {
+				if (errno == EINTR || errno == ECONNABORTED) continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK) std::cerr << "accept: " << strerror (errno) << std::endl;
+				return;
+			}
+			int one = 1;
+			setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one); // fails harmlessly on Unix domain sockets
+			connections [fd] = boost::shared_ptr<Connection> (new Connection (fd));
+			metrics::opened();
+			watch (fd, EPOLLIN, EPOLL_CTL_ADD);
+		}
+	}
+
+	void closeConnection (boost::shared_ptr<Connection> c) {
+		epoll_ctl (epoll, EPOLL_CTL_DEL, c->fd, 0);
+		c->streams.closeAll(); // fail streamed requests waiting for credits
+		shutdown (c->fd, SHUT_RDWR); // fd itself is closed once workers are done with it
+		connections.erase (c->fd);
+		stalled.erase (c);
+		writing.erase (c);
+		metrics::queued (- (long) c->waiting.size());
+		c->waiting.clear();
+		metrics::closed();
+	}
+
+	/** Move complete requests from connection's input to its waiting list */
+	void parse (boost::shared_ptr<Connection> c) {
+		size_t used = 0;
+		for (;;) {
+			if (c->framed) {
+				if (c->input.size() - used < frame::HeaderSize) break;
+				frame::Header h = frame::parseHeader (c->input.data() + used);
+				if (c->input.size() - used < frame::HeaderSize + h.length) break;
+				if (h.type == frame::Ping) {
+					used += frame::HeaderSize + h.length;
+					boost::lock_guard<boost::mutex> lock (c->mutex);
+					queueOutput (*c, frame::encode (frame::Ping, 0, h.id, ""));
+					continue;
+				}
+				if (h.type == frame::Credit) {
+					c->streams.grant (h.id, frame::decodeCredit (c->input.substr (used + frame::HeaderSize, h.length)));
+					used += frame::HeaderSize + h.length;
+					continue;
+				}
+				if (h.type != frame::Request) throw std::runtime_error ("Unexpected frame type " + to_string ((unsigned) h.type));
+				Task t (c, true, h.flags, h.id);
+				t.request.data.assign (c->input, used + frame::HeaderSize, h.length);
+				used += frame::HeaderSize + h.length;
+				if (!t.compressed && options.immediate && options.immediate (t.request)) { // must not wait for a worker behind the call it concerns
+					t.ordered = false;
+					run (t); // output is queued, and written once pump watches for room
+					continue;
+				}
+				c->waiting.push_back (t);
+				metrics::queued (1);
+			} else {
+				if (used == c->input.size()) break;
+				InputView view (c->input.data() + used, c->input.data() + c->input.size());
+				std::istream in (&view);
+				call::Request request;
+				if (! (in >> request)) {
+					if (c->input.size() - used > frame::maxLength) throw std::runtime_error ("Request too large");
+					break; // incomplete
+				}
+				used += view.consumed();
+				if (!c->refused.empty() || frame::isOtherHello (request.data, c->refused)) { // Hello comes first, so nothing is waiting to be answered before
+					std::ostringstream out;
+					out << Left<call::Response> (call::Exception (c->refused));
+					boost::lock_guard<boost::mutex> lock (c->mutex);
+					queueOutput (*c, out.str());
+					continue;
+				}
+				bool compress, handles;
+				if (frame::isHello (request.data, compress, handles)) { // client sends Hello before anything else, so nothing is waiting to be answered
+					c->compress = compress && compression::enabled;
+					std::ostringstream out;
+					out << Right<call::Exception> (call::Response (frame::helloAck (c->compress, handles && call::servesHandles)));
+					boost::lock_guard<boost::mutex> lock (c->mutex);
+					queueOutput (*c, out.str());
+					c->framed = true;
+					continue;
+				}
+				Task t (c, false, 0, 0);
+				t.request = request;
+				c->waiting.push_back (t);
+				metrics::queued (1);
+			}
+		}
+		c->input.erase (0, used);
+	}
+
+	/** Give connection's waiting requests to workers, as far as ordering and queue depth allow */
+	void pump (boost::shared_ptr<Connection> c) {
+		stalled.erase (c);
+		while (!c->waiting.empty()) {
+			Task &t = c->waiting.front();
+			if (t.ordered) {
+				boost::lock_guard<boost::mutex> lock (c->mutex);
+				if (c->busy) break;
+				c->busy = true; // before queueing, since a worker clears it when done
+			}
+			if (workers->depth() >= (long) options.queueDepth) {
+				if (t.ordered) {
+					boost::lock_guard<boost::mutex> lock (c->mutex);
+					c->busy = false;
+				}
+				stalled.insert (c);
+				break;
+			}
+			workers->submit (boost::bind (&Reactor::work, this, t), t.priority);
+			c->waiting.pop_front();
+		}
+		updateEvents (c);
+	}
+
+	/** Watch connection for input unless too many requests or too much output are pending, and for room to write while it has output queued */
+	void updateEvents (boost::shared_ptr<Connection> c) {
+		size_t queued;
+		{
+			boost::lock_guard<boost::mutex> lock (c->mutex);
+			queued = c->output.size();
+		}
+		unsigned events = (c->waiting.size() < options.maxPending && queued < MaxOutput ? EPOLLIN : 0) | (queued > 0 ? EPOLLOUT : 0);
+		if (events != c->events) {
+			watch (c->fd, events, EPOLL_CTL_MOD);
+			c->events = events;
+		}
+		if (queued > 0) writing.insert (c);
+		else writing.erase (c);
+	}
+
+	/** Write output the socket of c now has room for */
+	void writeTo (boost::shared_ptr<Connection> c) {
+		bool broken;
+		{
+			boost::lock_guard<boost::mutex> lock (c->mutex);
+			flushOutput (*c);
+			broken = c->broken;
+		}
+		if (broken) closeConnection (c);
+		else updateEvents (c);
+	}
+
+	/** Close connections whose client took none of their output for options.writeTimeout */
+	void dropStuck () {
+		long long limit = Task::now() - (long long) options.writeTimeout * 1000000;
+		std::vector < boost::shared_ptr<Connection> > stuck;
+		for (std::set < boost::shared_ptr<Connection> >::iterator it = writing.begin(); it != writing.end(); ++it) {
+			boost::lock_guard<boost::mutex> lock ((*it)->mutex);
+			if (!(*it)->output.empty() && (*it)->progress < limit) stuck.push_back (*it);
+		}
+		for (unsigned i = 0; i < stuck.size(); i++) {
+			std::cerr << "client not reading its responses, connection closed" << std::endl;
+			closeConnection (stuck[i]);
+		}
+	}
+
+	void readFrom (boost::shared_ptr<Connection> c) {
+		char buf [65536];
+		for (;;) {
+			ssize_t n = read (c->fd, buf, sizeof buf);
+			if (n > 0) {c->input.append (buf, n); continue;}
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+			closeConnection (c); // closed by client, or error
+			return;
+		}
+		try {parse (c);}
+		catch (std::exception &e) {
+			std::cerr << "connection to client aborted: (" << typeName(e) << ") " << e.what() << std::endl;
+			closeConnection (c);
+			return;
+		}
+		pump (c);
+	}
+
+	/** Pump connections whose requests finished, and connections stalled on a full queue */
+	void pumpWoken () {
+		uint64_t count;
+		if (read (wakeFd, &count, sizeof count) < 0 && errno != EAGAIN) std::cerr << "eventfd: " << strerror (errno) << std::endl;
+		std::vector < boost::shared_ptr<Connection> > cs;
+		{
+			boost::lock_guard<boost::mutex> lock (wokenMutex);
+			cs.swap (woken);
+		}
+		cs.insert (cs.end(), stalled.begin(), stalled.end());
+		for (unsigned i = 0; i < cs.size(); i++) {
+			std::map < int, boost::shared_ptr<Connection> >::iterator it = connections.find (cs[i]->fd);
+			if (it != connections.end() && it->second == cs[i]) pump (cs[i]);
+		}
+	}
+
+	/** Run request and write its response */
+	void run (Task &t) {
+		Connection &c = *t.connection;
+		std::string bytes;
+		if (t.framed) {
+			// catch any exception in respond function and return it to remote caller to be raised there
+			frame::Type type = frame::Response;
+			std::string body;
+			try {
+				if (t.compressed) compression::unpack (t.request.data);
+				if (t.streamed) {
+					streaming::Scope scope (boost::bind (&Reactor::sendChunk, this, t.connection, t.id, _1), c.streams.open (t.id));
+					body = respond (t.request) .data;
+				} else
+					body = respond (t.request) .data;
+			} catch (std::exception &e) {
+				type = frame::Error;
+				body = frame::encodeError (call::Exception (e));
+			}
+			if (t.streamed) c.streams.close (t.id);
+			bytes = frame::encode (type, c.compress && compression::pack (body) ? frame::Compressed : 0, t.id, body);
+		} else {
+			Either <call::Exception, call::Response> reply;
+			try {reply = Right<call::Exception> (respond (t.request));}
+			catch (std::exception &e) {reply = Left<call::Response> (call::Exception (e));}
+			std::ostringstream out;
+			out << reply;
+			bytes = out.str();
+		}
+		boost::lock_guard<boost::mutex> lock (c.mutex);
+		try {queueOutput (c, bytes);}
+		catch (std::exception &e) {} // client gone, reactor will notice
+		if (t.ordered) c.busy = false;
+	}
+
+	/** Write chunk of a streamed request from a worker. Throw if client is gone */
+	void sendChunk (boost::shared_ptr<Connection> c, boost::uint32_t id, std::string body) {
+		std::string bytes = frame::encode (frame::Chunk, c->compress && compression::pack (body) ? frame::Compressed : 0, id, body);
+		bool queued;
+		{
+			boost::lock_guard<boost::mutex> lock (c->mutex);
+			queueOutput (*c, bytes);
+			queued = !c->output.empty();
+		}
+		if (queued) wake (c); // so the reactor writes the rest
+	}
+
+	void wake (boost::shared_ptr<Connection> c) {
+		{
+			boost::lock_guard<boost::mutex> lock (wokenMutex);
+			woken.push_back (c);
+		}
+		uint64_t one = 1;
+		if (write (wakeFd, &one, sizeof one) < 0) std::cerr << "eventfd: " << strerror (errno) << std::endl;
+	}
+
+	void work (Task t) {
+		metrics::queued (-1);
+		long long waited = Task::now() - t.parsed;
+		trace::queued (waited);
+		deadline::queued (waited);
+		metrics::Running running;
+		run (t);
+		wake (t.connection);
+	}
+
+public:
+	/** Serve connections accepted from bound listener sockets, which reactor then owns */
+	Reactor (std::vector<int> listeners, boost::function1 <call::Response, call::Request> respond, call::ServerOptions options) : respond(respond), options(options), listeners(listeners) {
+		check (epoll = epoll_create1 (EPOLL_CLOEXEC), "epoll_create");
+		check (wakeFd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC), "eventfd");
+		for (unsigned i = 0; i < listeners.size(); i++) {
+			check (::listen (listeners[i], SOMAXCONN), "listen");
+			watch (listeners[i], EPOLLIN, EPOLL_CTL_ADD);
+		}
+		watch (wakeFd, EPOLLIN, EPOLL_CTL_ADD);
+	}
+
+	~Reactor () {
+		close (wakeFd);
+		close (epoll);
+		for (unsigned i = 0; i < listeners.size(); i++) close (listeners[i]);
+	}
+
+	/** Reactor thread. Stops with its workers when interrupted */
+	void loop () {
+		workers.reset (new executor::Executor (options.workers, options.interactiveWorkers));
+		try {
+			struct epoll_event events [64];
+			for (;;) {
+				boost::this_thread::interruption_point();
+				int n = epoll_wait (epoll, events, 64, 100);
+				if (n < 0 && errno != EINTR) check (n, "epoll_wait");
+				for (int i = 0; i < n; i++) {
+					int fd = events[i].data.fd;
+					if (std::find (listeners.begin(), listeners.end(), fd) != listeners.end()) acceptAll (fd);
+					else if (fd == wakeFd) pumpWoken ();
+					else {
+						std::map < int, boost::shared_ptr<Connection> >::iterator it = connections.find (fd);
+						if (it == connections.end()) continue;
+						boost::shared_ptr<Connection> c = it->second;
+						if (events[i].events & EPOLLOUT) writeTo (c);
+						it = connections.find (fd);
+						if ((events[i].events & ~EPOLLOUT) && it != connections.end() && it->second == c) readFrom (c);
+					}
+				}
+				if (!writing.empty()) dropStuck ();
+			}
+		} catch (boost::thread_interrupted &) {
+		} catch (std::exception &e) {
+			std::cerr << "server stopped: (" << typeName(e) << ") " << e.what() << std::endl;
+		}
+		workers.reset();
+		while (!connections.empty()) closeConnection (connections.begin()->second);
+		stalled.clear();
+	}
+};
+
+static boost::shared_ptr<boost::thread> serve (std::vector<int> listeners, boost::function1 <call::Response, call::Request> respond, call::ServerOptions options) {
+	boost::shared_ptr<Reactor> reactor (new Reactor (listeners, respond, options));
+	return boost::shared_ptr<boost::thread> (new boost::thread (boost::bind (&Reactor::loop, reactor)));
+}
+
+boost::shared_ptr<boost::thread> call::serve (network::Port port, boost::function1 <Response, Request> respond, ServerOptions options) {
+	std::vector<int> listeners (1, tcpListener (port));
+	if (!options.localPath.empty()) listeners.push_back (localListener (options.localPath));
+	return ::serve (listeners, respond, options);
+}
+
+boost::shared_ptr<boost::thread> call::serveLocal (std::string path, boost::function1 <Response, Request> respond, ServerOptions options) {
+	return ::serve (std::vector<int> (1, localListener (path)), respond, options);
+}
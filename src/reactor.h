@@ -0,0 +1,30 @@
+/* Event-driven server for the call protocol. One reactor thread accepts connections and reads requests from all of them with epoll without blocking, and a fixed pool of worker threads runs complete requests. Thousands of mostly idle connections then cost a buffer each instead of a thread each.
+ * Requests of a connection run one at a time in order, except framed requests flagged Concurrent (see frame.h), which may run alongside later ones and be answered out of order.
+ * Workers form a work-stealing executor (see executor.h). Requests flagged Bulk only run when no interactive request is waiting, and never on the workers reserved for interactive requests.
+ * Nothing waits for a client to read: what its socket does not take at once is queued and written by the reactor thread when there is room, and a client that reads nothing for `writeTimeout` is disconnected. */
+
+#pragma once
+
+#include "call.h"
+#include "executor.h"
+
+namespace call {
+
+struct ServerOptions {
+	unsigned workers;  // threads running requests. Defaults to number of cores
+	unsigned interactiveWorkers;  // of which reserved for interactive requests. Default 1
+	unsigned queueDepth;  // max requests waiting for a worker. Connections are not read while the queue is full
+	unsigned maxPending;  // max requests read from one connection but not yet given to a worker, beyond which the connection is not read
+	unsigned writeTimeout;  // seconds a client may leave its responses unread before its connection is closed. Default 30
+	boost::function1 <bool, Request> immediate;  // if set, framed requests it holds for are run by the reactor thread as soon as read, so they must be quick, eg. deadline::isCancel. Default none
+	std::string localPath;  // if not empty, also accept connections on this Unix domain socket (see call::localPath)
+	ServerOptions ();
+};
+
+/** Same as `listen` except connections are served by an event loop and a pool of worker threads. Returns reactor thread, which you may interrupt to stop serving */
+boost::shared_ptr<boost::thread> serve (network::Port, boost::function1 <Response, Request>, ServerOptions = ServerOptions());
+
+/** Same as above except listen on Unix domain socket at path, see `listenLocal` */
+boost::shared_ptr<boost::thread> serveLocal (std::string path, boost::function1 <Response, Request>, ServerOptions = ServerOptions());
+
+}
@@ -1,9 +1,18 @@
 
 #include "remote.h"
+#include "manifest.h"
+#include "intern.h"
+#include "memo.h"
+#include "metrics.h"
+#include "trace.h"
+#include "deadline.h"
+#include "pool.h"
+#include <boost/bind.hpp>
 #include <10util/util.h> // split_string
 
 /** Extract hostname and port from "Hostname:Port", or "Hostname" which uses default port */
 network::HostPort remote::hostPort (Host host) {
+	if (host.compare (0, call::LocalPrefix.size(), call::LocalPrefix) == 0) return network::HostPort (host, 0);
 	std::vector<std::string> tokens = split_string (':', host);
 	std::string hostname = tokens[0];
 	unsigned short port = tokens.size() < 2 ? DefaultPort : parse_string <network::Port> (tokens[1]);
@@ -11,22 +20,230 @@ network::HostPort remote::hostPort (Host host) {
 }
 
 network::Port remote::ListenPort = 0;
+static remote::Host localHost;  // "unix:Path" if listening only there
 
 /** Return public hostname of this machine with port we are listening on (must already be listening) */
 remote::Host remote::thisHost () {
+	if (!localHost.empty()) return localHost;
 	if (ListenPort == 0) throw std::runtime_error ("Not listening yet. Call remote::listen first");
 	return network::myHostname() + ":" + to_string (ListenPort);
 }
 
-/** Request is an encoded ThunkSerialOut, Response is an io::Code */
-static io::Code reply (io::Code closure) {
-	return io::decode<remote::Closure> (closure) ();
+/** Request is an encoded Closure or function handle with args (see intern.h), or an invalidation of memoized results (see memo.h). Response is an io::Code */
+static io::Code dispatch (io::Code request) {
+	if (memo::isInvalidation (request)) return memo::reply (request);
+	if (metrics::isStatsRequest (request)) return metrics::reply (request);
+	if (trace::isSpansRequest (request)) return trace::reply (request);
+	if (pipeline::isRequest (request)) return pipeline::reply (request);
+	if (deadline::isCancel (request)) return deadline::reply (request);
+	return intern::reply (request);
+}
+
+/** Host we serve as, for spans */
+static std::string servingHost () {
+	try {return remote::thisHost();}
+	catch (std::exception &e) {return "";}
+}
+
+/** A traced request is served in its trace, see trace.h */
+static io::Code replyTraced (io::Code request) {
+	if (!trace::isTraced (request)) return dispatch (request);
+	trace::Server span (request, servingHost());
+	return dispatch (request);
+}
+
+/** A request with a deadline is given up on once it passes, see deadline.h */
+static io::Code reply (io::Code request) {
+	if (!deadline::has (request)) return replyTraced (request);
+	return deadline::serve (request, replyTraced);
+}
+
+/** Call with retry if server did not know function handle, and if idempotent also if the connection failed */
+static io::Code evalTraced (remote::Closure closure, network::HostPort hp, executor::Priority priority, bool idempotent, const trace::Client &span) {
+	bool interning;
+	io::Code request = intern::request (hp, closure, interning);
+	try {
+		return intern::result (hp, closure.fun, interning, pool::call (hp, deadline::request (span.request (request)), priority, idempotent));
+	} catch (call::Exception &e) {
+		if (!intern::isUnknown (e)) throw;
+		intern::forget (hp); // server restarted, send whole closure again
+		request = intern::request (hp, closure, interning);
+		return intern::result (hp, closure.fun, interning, pool::call (hp, deadline::request (span.request (request)), priority, idempotent));
+	}
+}
+
+static io::Code evalSpanned (remote::Closure closure, remote::Host host, executor::Priority priority, bool idempotent) {
+	trace::Client span (closure.fun.funSig.funName, host);
+	try {
+		io::Code result = evalTraced (closure, remote::hostPort (host), priority, idempotent, span);
+		span.finish (false);
+		return result;
+	} catch (std::exception &e) {
+		span.finish (true);
+		throw;
+	}
+}
+
+io::Code remote::_eval (Closure closure, Host host, executor::Priority priority) {
+	return evalSpanned (closure, host, priority, false);
+}
+
+io::Code remote::_evalIdempotent (Closure closure, Host host, executor::Priority priority) {
+	return evalSpanned (closure, host, priority, true);
+}
+
+/** Fulfil promise with result of response, sending whole closure again if server did not know its handle. The retry carries the deadline and cancel token of the caller, which the thread receiving the response does not have */
+static void received (future::Promise<io::Code> promise, network::HostPort hp, remote::Closure closure, executor::Priority priority, bool interning, boost::shared_ptr<trace::Client> span, deadline::Context context, future::Future<call::Response> response) {
+	try {
+		io::Code result = intern::result (hp, closure.fun, interning, response.get());
+		span->finish (false);
+		promise.setValue (result);
+	} catch (call::Timeout &e) {
+		span->finish (true);
+		promise.setError (boost::copy_exception (e));
+	} catch (call::Exception &e) {
+		if (!intern::isUnknown (e) || interning) {
+			span->finish (true);
+			promise.setError (boost::copy_exception (e));
+			return;
+		}
+		intern::forget (hp);
+		try {
+			deadline::Adopt scope (context);
+			io::Code request = intern::request (hp, closure, interning);
+			future::Future<call::Response> retry = call::send (hp, deadline::request (span->request (request)), priority);
+			retry.onReady (boost::bind (received, promise, hp, closure, priority, interning, span, context, retry));
+		} catch (std::exception &x) { // eg. deadline passed
+			span->finish (true);
+			promise.setError (x);
+		}
+	} catch (std::exception &e) {
+		span->finish (true);
+		promise.setError (e);
+	}
+}
+
+future::Future<io::Code> remote::_evalAsync (Closure closure, Host host, executor::Priority priority) {
+	network::HostPort hp = hostPort (host);
+	bool interning;
+	io::Code request = intern::request (hp, closure, interning);
+	boost::shared_ptr<trace::Client> span (new trace::Client (closure.fun.funSig.funName, host));
+	future::Promise<io::Code> promise;
+	future::Future<call::Response> response = call::send (hp, deadline::request (span->request (request)), priority);
+	response.onReady (boost::bind (received, promise, hp, closure, priority, interning, span, deadline::current(), response));
+	return promise.future();
+}
+
+future::Future<io::Code> remote::_evalStream (Closure closure, Host host, executor::Priority priority, boost::shared_ptr<streaming::Queue> queue) {
+	trace::Client span (closure.fun.funSig.funName, host); // joins trace, but spans of streams are not recorded
+	return call::sendStreamed (hostPort (host), span.request (io::encode (closure)), queue, priority);
+}
+
+/** Path of "unix:Path" host, or empty if host is a network host */
+static std::string localPath (remote::Host host) {
+	return host.compare (0, call::LocalPrefix.size(), call::LocalPrefix) == 0 ? host.substr (call::LocalPrefix.size()) : "";
+}
+
+
+metrics::Snapshot remote::stats (Host host) {
+	return io::decode<metrics::Snapshot> (call::call (hostPort (host), metrics::request()));
+}
+
+/** Host of first stage, or host if it names none */
+static remote::Host firstHost (const pipeline::Stages &stages, remote::Host host) {
+	if (stages.empty()) throw std::runtime_error ("Empty pipeline");
+	return stages[0].host.empty() ? host : stages[0].host;
+}
+
+io::Code remote::_evalPipeline (const pipeline::Stages &stages, Host host, executor::Priority priority) {
+	host = firstHost (stages, host);
+	trace::Client span (stages[0].closure.fun.funSig.funName, host);
+	try {
+		io::Code result = call::call (hostPort (host), deadline::request (span.request (pipeline::request (stages, priority))), priority);
+		span.finish (false);
+		return result;
+	} catch (std::exception &e) {
+		span.finish (true);
+		throw;
+	}
+}
+
+static void pipelineReceived (future::Promise<io::Code> promise, boost::shared_ptr<trace::Client> span, future::Future<call::Response> response) {
+	try {
+		io::Code result = response.get();
+		span->finish (false);
+		promise.setValue (result);
+	} catch (call::Timeout &e) {
+		span->finish (true);
+		promise.setError (boost::copy_exception (e));
+	} catch (call::Exception &e) {
+		span->finish (true);
+		promise.setError (boost::copy_exception (e));
+	} catch (std::exception &e) {
+		span->finish (true);
+		promise.setError (e);
+	}
+}
+
+future::Future<io::Code> remote::_evalPipelineAsync (const pipeline::Stages &stages, Host host, executor::Priority priority) {
+	host = firstHost (stages, host);
+	boost::shared_ptr<trace::Client> span (new trace::Client (stages[0].closure.fun.funSig.funName, host));
+	future::Promise<io::Code> promise;
+	future::Future<call::Response> response = call::send (hostPort (host), deadline::request (span->request (pipeline::request (stages, priority))), priority);
+	response.onReady (boost::bind (pipelineReceived, promise, span, response));
+	return promise.future();
+}
+
+std::vector<trace::Span> remote::traces (Host host) {
+	return io::decode < std::vector<trace::Span> > (call::call (hostPort (host), trace::request()));
+}
+
+void remote::invalidate (FunctionId fun, Host host) {
+	call::call (hostPort (host), memo::request (fun));
+}
+
+void remote::_invalidate (Closure closure, Host host) {
+	call::call (hostPort (host), memo::request (closure));
 }
 
 /** Start thread that will accept `remote::eval` requests from the network */
 boost::shared_ptr <boost::thread> remote::listen (remote::Host myHost) {
+	call::servesHandles = true;
+	std::string path = localPath (myHost);
+	if (!path.empty()) {
+		localHost = myHost;
+		return call::listenLocal (path, reply);
+	}
 	network::HostPort h = hostPort (myHost);
 	ListenPort = h.port;
 	network::initMyHostname (h.hostname);
-	return call::listen (ListenPort, reply);
+	boost::shared_ptr <boost::thread> listener = call::listen (ListenPort, reply);
+	if (call::useLocal) {
+		// a failure only costs local callers the fast path
+		try {call::listenLocal (call::localPath (ListenPort), reply);}
+		catch (std::exception &e) {std::cerr << "Not listening on " << call::localPath (ListenPort) << ": " << e.what() << std::endl;}
+	}
+	return listener;
+}
+
+/** Start reactor thread that will accept `remote::eval` requests, run by a pool of worker threads */
+boost::shared_ptr <boost::thread> remote::listen (remote::Host myHost, call::ServerOptions options) {
+	call::servesHandles = true;
+	if (!options.immediate) options.immediate = deadline::isCancel; // a cancel must not queue behind the call it cancels
+	std::string path = localPath (myHost);
+	if (!path.empty()) {
+		localHost = myHost;
+		return call::serveLocal (path, reply, options);
+	}
+	network::HostPort h = hostPort (myHost);
+	ListenPort = h.port;
+	network::initMyHostname (h.hostname);
+	if (call::useLocal && options.localPath.empty()) options.localPath = call::localPath (ListenPort);
+	return call::serve (ListenPort, reply, options);
+}
+
+/** Start thread that will accept `remote::eval` requests after preloading stubs of functions in manifest */
+boost::shared_ptr <boost::thread> remote::listen (remote::Host myHost, std::string manifestPath) {
+	manifest::preload (manifestPath, manifest::library (manifestPath));
+	return listen (myHost);
 }
@@ -7,13 +7,20 @@
 #include <10util/unit.h>
 #include "function.h"
 #include "call.h"
+#include "channel.h"
+#include "reactor.h"
+#include "streaming.h"
+#include "metrics.h"
+#include "trace.h"
+#include "pipeline.h"
+#include "deadline.h"
 
 namespace remote {
 
-	/** "Hostname:Port" or "Hostname" which will use default port */
+	/** "Hostname:Port" or "Hostname" which will use default port, or "unix:Path" of a Unix domain socket on this machine */
 	typedef std::string Host;
 
-	/** Extract hostname and port from "Hostname:Port", or "Hostname" which uses default port */
+	/** Extract hostname and port from "Hostname:Port", or "Hostname" which uses default port. "unix:Path" is kept whole as hostname */
 	network::HostPort hostPort (Host);
 
 	const network::Port DefaultPort = 16968;
@@ -21,19 +28,149 @@ namespace remote {
 	/** Port we are listening on. Set by `listen` */
 	extern network::Port ListenPort;
 
-	/** Start thread that will accept `eval` requests on given network interface (host) */
+	/** Start thread that will accept `eval` requests on given network interface (host). Unless `call::useLocal` is off, also accept them from this machine on Unix domain socket `call::localPath (port)`, so local callers skip tcp loopback. That listener runs for the life of the process. If host is "unix:Path" only listen there */
 	boost::shared_ptr <boost::thread> listen (remote::Host myHost);
 
-	/** Return public hostname of this machine with port we are listening on */
+	/** Same as above except serve connections with an event loop and a bounded pool of worker threads instead of a thread per connection (see reactor.h). The event loop also serves the Unix domain socket */
+	boost::shared_ptr <boost::thread> listen (remote::Host myHost, call::ServerOptions);
+
+	/** Same as first `listen` except first preload stubs of functions in manifest (see manifest.h), so the first call of each is as fast as later ones */
+	boost::shared_ptr <boost::thread> listen (remote::Host myHost, std::string manifestPath);
+
+	/** Return public hostname of this machine with port we are listening on, or "unix:Path" we are listening on */
 	Host thisHost ();
 
-	/** Execute action on given host, wait for its completion, and return its result */
-	template <class O> O eval (Function0<O> action, Host host) {
-		io::Code result = call::call (hostPort (host), io::encode (action.closure));
+	/** Send closure to host and wait for its encoded result. Its function is sent as a handle if host gave us one (see intern.h) */
+	io::Code _eval (Closure, Host, executor::Priority);
+
+	/** Same as `_eval` except return immediately */
+	future::Future<io::Code> _evalAsync (Closure, Host, executor::Priority);
+
+	/** Execute action on given host, wait for its completion, and return its result. Mark long running actions Bulk so they do not delay interactive ones on the host */
+	template <class O> O eval (Function0<O> action, Host host, executor::Priority priority = executor::Interactive) {
+		io::Code result = _eval (action.closure, host, priority);
 		return io::decode<O> (result);
 	}
-	template <> inline void eval<void> (Function0<void> action, Host host) {
-		call::call (hostPort (host), io::encode (action.closure));
+	template <> inline void eval<void> (Function0<void> action, Host host, executor::Priority priority) {
+		_eval (action.closure, host, priority);
+	}
+
+	/** Same as `_eval` for an action safe to run twice */
+	io::Code _evalIdempotent (Closure, Host, executor::Priority);
+
+	/** Same as `eval` for an action that is safe to run twice: if the connection fails before the result came, the action is sent again over another connection, up to `pool::options.retries` times (see pool.h) */
+	template <class O> O evalIdempotent (Function0<O> action, Host host, executor::Priority priority = executor::Interactive) {
+		return io::decode<O> (_evalIdempotent (action.closure, host, priority));
+	}
+	template <> inline void evalIdempotent<void> (Function0<void> action, Host host, executor::Priority priority) {
+		_evalIdempotent (action.closure, host, priority);
+	}
+
+	/** Same as `eval` except raise call::Timeout unless action finishes within timeout, after which host interrupts it (see deadline.h) */
+	template <class O> O eval (Function0<O> action, Host host, boost::posix_time::time_duration timeout, executor::Priority priority = executor::Interactive) {
+		deadline::Scope scope (timeout);
+		return eval (action, host, priority);
+	}
+
+	template <class O> O _decode (future::Future<io::Code> result) {return io::decode<O> (result.get());}
+	inline void _decodeVoid (future::Future<io::Code> result) {result.get();}
+
+	/** Same as `eval` except return immediately. The call shares this process's channel to host with other calls in flight (see channel.h) instead of blocking a thread */
+	template <class O> future::Future<O> evalAsync (Function0<O> action, Host host, executor::Priority priority = executor::Interactive) {
+		return _evalAsync (action.closure, host, priority) .template then<O> (_decode<O>);
+	}
+	template <> inline future::Future<void> evalAsync<void> (Function0<void> action, Host host, executor::Priority priority) {
+		return _evalAsync (action.closure, host, priority) .then<void> (_decodeVoid);
+	}
+
+	/** Send pipeline to host, which runs it and forwards its later stages on to theirs (see pipeline.h). Encoded result of last stage */
+	io::Code _evalPipeline (const pipeline::Stages&, Host, executor::Priority);
+	future::Future<io::Code> _evalPipelineAsync (const pipeline::Stages&, Host, executor::Priority);
+
+	/** Actions composed so each stage's result is fed into the next, run by servers in one request per host instead of one round trip per stage through the caller. O is the result of the last stage */
+	template <class O> struct Pipeline {
+		pipeline::Stages stages;
+		/** Pipeline of action alone, run on the host the pipeline is sent to unless given another */
+		Pipeline (Function0<O> action, Host host = "") {stages.push_back (pipeline::Stage (action.closure, host));}
+		Pipeline () {} // for serialization
+		/** Feed result of this pipeline to next, run on host, or where the last stage ran if host is empty */
+		template <class B> Pipeline<B> then (Function1<B,O> next, Host host = "") const {
+			Pipeline<B> p;
+			p.stages = stages;
+			p.stages.push_back (pipeline::Stage (next.closure, host));
+			return p;
+		}
+	};
+
+	/** Pipeline of act1 then act2, same as `composeAct0` except evaluated where it is sent */
+	template <class B, class A> Pipeline<B> compose (Function1<B,A> act2, Function0<A> act1) {return Pipeline<A> (act1) .then (act2);}
+
+	/** Run pipeline, its first stage on host unless it names its own, and return result of its last stage. Intermediate results go from host to host without coming back here */
+	template <class O> O evalPipeline (const Pipeline<O> &p, Host host, executor::Priority priority = executor::Interactive) {
+		return io::decode<O> (_evalPipeline (p.stages, host, priority));
+	}
+	template <> inline void evalPipeline<void> (const Pipeline<void> &p, Host host, executor::Priority priority) {
+		_evalPipeline (p.stages, host, priority);
+	}
+
+	/** Same as above except return immediately */
+	template <class O> future::Future<O> evalPipelineAsync (const Pipeline<O> &p, Host host, executor::Priority priority = executor::Interactive) {
+		return _evalPipelineAsync (p.stages, host, priority) .template then<O> (_decode<O>);
+	}
+	template <> inline future::Future<void> evalPipelineAsync<void> (const Pipeline<void> &p, Host host, executor::Priority priority) {
+		return _evalPipelineAsync (p.stages, host, priority) .then<void> (_decodeVoid);
+	}
+
+	/** Call counts and latencies of functions host ran, and its load (see metrics.h) */
+	metrics::Snapshot stats (Host host);
+
+	/** Spans host recorded, see trace.h */
+	std::vector<trace::Span> traces (Host host);
+
+	void _invalidate (Closure, Host);
+
+	/** Make host forget its memoized result of action, so the next eval of it runs it again (see memo.h) */
+	template <class O> void invalidate (Function0<O> action, Host host) {_invalidate (action.closure, host);}
+
+	/** Make host forget all its memoized results of fun */
+	void invalidate (FunctionId fun, Host host);
+
+	/** Send closure to host as a Streamed request, its chunks pushed to queue. Whole closure is sent, never a handle, so there is nothing to retry once chunks have arrived */
+	future::Future<io::Code> _evalStream (Closure, Host, executor::Priority, boost::shared_ptr<streaming::Queue>);
+
+	/** Values a remote action `streaming::put`s, in order, see `evalStream` */
+	template <class T> class Stream {
+		boost::shared_ptr<streaming::Queue> queue;
+		future::Future<io::Code> done;
+		boost::shared_ptr<void> reading;  // cancels the stream once the last copy of it is gone
+	public:
+		Stream (boost::shared_ptr<streaming::Queue> queue, future::Future<io::Code> done) : queue(queue), done(done), reading (queue.get(), boost::bind (&streaming::Queue::cancel, queue)) {}
+		/** Wait for next value. Return false once action returned or stream was closed, or raise action's exception */
+		bool next (T &x) {
+			std::string chunk;
+			if (queue->pop (chunk)) {
+				x = io::decode<T> (io::Code (chunk));
+				return true;
+			}
+			if (queue->isCancelled()) return false;
+			done.get();
+			return false;
+		}
+		/** Stop reading values: the action fails at its next `put` rather than wait for us. Ignored if it returned already */
+		void close () {queue->cancel();}
+	};
+
+	/** Execute action on given host, which sends its results as it produces them with `streaming::put<T>`, and return immediately with a stream of them. The action waits whenever it gets a window of values ahead of the caller */
+	template <class T> Stream<T> evalStream (Function0<void> action, Host host, executor::Priority priority = executor::Interactive) {
+		boost::shared_ptr<streaming::Queue> queue (new streaming::Queue);
+		return Stream<T> (queue, _evalStream (action.closure, host, priority, queue));
+	}
+
+	/** Same as above except apply consume to each value as it arrives, and return once action returned */
+	template <class T> void evalStream (Function0<void> action, Host host, boost::function1 <void, T> consume, executor::Priority priority = executor::Interactive) {
+		Stream<T> stream = evalStream<T> (action, host, priority);
+		T x;
+		while (stream.next (x)) consume (x);
 	}
 
 	/** A value that is pertinent to some host */
@@ -62,6 +199,16 @@ namespace remote {
 		return eval (bind (action, ref.value), ref.host);
 	}
 
+	/** Same as `apply` except raise call::Timeout unless action finishes within timeout, see `eval` */
+	template <class O, class T> O apply (Function1<O,T> action, Remote<T> ref, boost::posix_time::time_duration timeout) {
+		return eval (bind (action, ref.value), ref.host, timeout);
+	}
+
+	/** Same as `apply` except return immediately, see `evalAsync` */
+	template <class O, class T> future::Future<O> applyAsync (Function1<O,T> action, Remote<T> ref) {
+		return evalAsync (bind (action, ref.value), ref.host);
+	}
+
 	/** Same as `apply` except include host with result. */
 	template <class O, class T> Remote<O> applyR (Function1<O,T> action, Remote<T> ref) {
 		O res = apply (action, ref);
@@ -0,0 +1,124 @@
+#include "scatter.h"
+#include <deque>
+#include <algorithm>
+#include <boost/thread.hpp>
+
+class scatter::Run {
+	boost::mutex mutex;  // guards below
+	boost::condition_variable changed;
+	std::deque<Outcome> done;  // not taken by `next` yet
+	unsigned nextHost;
+	unsigned running;  // callers
+	unsigned succeeded, failed;
+	bool stopped, lost;
+public:
+	const remote::Closure closure;
+	const std::vector<std::string> hosts;
+	const Options options;
+	const deadline::Context callerDeadline;
+	const trace::Context callerTrace;
+
+	Run (remote::Closure closure, std::vector<std::string> hosts, Options options) : nextHost(0), running(0), succeeded(0), failed(0),
+		stopped(false), lost(false), closure(closure), hosts(hosts), options(options), callerDeadline(deadline::current()), callerTrace(trace::current()) {}
+
+	/** Index of next host to call, or false if none left */
+	bool take (unsigned &i) {
+		boost::lock_guard<boost::mutex> lock (mutex);
+		if (stopped || nextHost == hosts.size()) return false;
+		i = nextHost++;
+		return true;
+	}
+
+	void started () {
+		boost::lock_guard<boost::mutex> lock (mutex);
+		running++;
+	}
+
+	/** Caller has no more hosts to call */
+	void exited () {
+		boost::lock_guard<boost::mutex> lock (mutex);
+		running--;
+		changed.notify_all();
+	}
+
+	/** Add outcome of a host and apply policy */
+	void add (const Outcome &o) {
+		boost::lock_guard<boost::mutex> lock (mutex);
+		if (stopped) return; // dropped
+		done.push_back (o);
+		if (o.ok) succeeded++;
+		else failed++;
+		switch (options.policy) {
+		case FailFast: stopped = !o.ok; break;
+		case Quorum:
+			if (succeeded >= options.quorum) stopped = true;
+			else if (hosts.size() - failed < options.quorum) stopped = lost = true;
+			break;
+		case BestEffort: break;
+		}
+		changed.notify_all();
+	}
+
+	bool next (Outcome &o) {
+		boost::unique_lock<boost::mutex> lock (mutex);
+		for (;;) {
+			if (!done.empty()) {
+				o = done.front();
+				done.pop_front();
+				return true;
+			}
+			if (stopped || (running == 0 && nextHost == hosts.size())) return false;
+			changed.wait (lock);
+		}
+	}
+
+	void stop () {
+		boost::lock_guard<boost::mutex> lock (mutex);
+		stopped = true;
+		changed.notify_all();
+	}
+
+	bool quorumLost () {
+		boost::lock_guard<boost::mutex> lock (mutex);
+		return lost;
+	}
+};
+
+/** Call hosts one after another until there are none left or run stops, under the deadline and trace of the thread that started run */
+static void caller (boost::shared_ptr<scatter::Run> run) {
+	deadline::Adopt timing (run->callerDeadline);
+	trace::Adopt tracing (run->callerTrace);
+	unsigned i;
+	while (run->take (i)) {
+		scatter::Outcome o;
+		o.host = run->hosts[i];
+		try {
+			o.value = remote::_eval (run->closure, o.host, run->options.priority);
+			o.ok = true;
+		} catch (call::Exception &e) {
+			o.error = e;
+		} catch (std::exception &e) {
+			o.error = call::Exception (e); // eg. could not connect
+		}
+		run->add (o);
+	}
+	run->exited();
+}
+
+boost::shared_ptr<scatter::Run> scatter::start (remote::Closure closure, std::vector<std::string> hosts, Options options) {
+	if (options.policy == Quorum && (options.quorum == 0 || options.quorum > hosts.size()))
+		throw std::invalid_argument ("Quorum of " + to_string (options.quorum) + " out of " + to_string (hosts.size()) + " hosts");
+	boost::shared_ptr<Run> run (new Run (closure, hosts, options));
+	unsigned callers = std::min ((size_t) std::max (options.concurrency, 1u), hosts.size());
+	for (unsigned i = 0; i < callers; i++) {
+		run->started(); // before thread starts, so `next` does not see none running yet
+		boost::thread _th (boost::bind (caller, run));
+	}
+	return run;
+}
+
+bool scatter::next (boost::shared_ptr<Run> run, Outcome &outcome) {return run->next (outcome);}
+
+void scatter::stop (boost::shared_ptr<Run> run) {run->stop();}
+
+bool scatter::quorumLost (boost::shared_ptr<Run> run) {return run->quorumLost();}
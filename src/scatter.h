@@ -0,0 +1,114 @@
+/* Evaluate an action on many hosts at once and gather the results as they complete. At most `concurrency` hosts are called at a time, by that many threads over pooled connections, so calling thousands of hosts takes neither thousands of threads nor thousands of open channels (each channel has its own reader thread, see channel.h).
+ * A policy decides what a failure does: FailFast stops calling hosts at the first one, Quorum stops once enough hosts succeeded (or too many failed for that to happen), and BestEffort calls every host and collects failures along with results. */
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <stdexcept>
+#include "remote.h"
+
+namespace scatter {
+
+	enum Policy {
+		FailFast,  // stop at first failure and raise it
+		Quorum,  // stop once `quorum` hosts succeeded, and raise QuorumLost if too many failed for that
+		BestEffort  // call every host, collecting failures
+	};
+
+	struct Options {
+		unsigned concurrency;  // hosts called at once. Default 64
+		Policy policy;  // default FailFast
+		unsigned quorum;  // successes needed under Quorum
+		executor::Priority priority;  // of calls on hosts. Default Interactive
+		Options () : concurrency (64), policy (FailFast), quorum (0), priority (executor::Interactive) {}
+	};
+
+	/** Raised under Quorum once too many hosts failed to reach it */
+	class QuorumLost : public std::runtime_error {
+	public:
+		QuorumLost (std::string message) : std::runtime_error (message) {}
+	};
+
+	/** Result of one host, encoded, or the exception it raised */
+	struct Outcome {
+		std::string host;
+		bool ok;
+		io::Code value;
+		call::Exception error;
+		Outcome () : ok(false) {}
+	};
+
+	/** Calls of one closure on many hosts in progress. Calls still running once it stops are left to finish and their outcomes dropped */
+	class Run;
+
+	boost::shared_ptr<Run> start (remote::Closure closure, std::vector<std::string> hosts, Options options);
+
+	/** Wait for next outcome, in order of completion. False once there are no more, because every host was called or the run stopped */
+	bool next (boost::shared_ptr<Run> run, Outcome &outcome);
+
+	/** Call no more hosts */
+	void stop (boost::shared_ptr<Run> run);
+
+	/** Whether run stopped because its quorum can no longer be reached */
+	bool quorumLost (boost::shared_ptr<Run> run);
+
+}
+
+namespace remote {
+
+	/** Results and failures of an action scattered over hosts */
+	template <class O> struct Gathered {
+		std::vector< Remote <typename future::Slot<O>::type> > results;  // in order of completion
+		std::vector< std::pair <Host, call::Exception> > failures;
+	};
+
+	/** Action being evaluated on many hosts, see `scatter` */
+	template <class O> class Scatter {
+		boost::shared_ptr<scatter::Run> run;
+		scatter::Policy policy;
+		std::vector< std::pair <Host, call::Exception> > failed;
+	public:
+		typedef typename future::Slot<O>::type Value;
+		Scatter (boost::shared_ptr<scatter::Run> run, scatter::Policy policy) : run(run), policy(policy) {}
+		/** Wait for next result, in order of completion. Return false once there are no more, or raise the first failure under FailFast */
+		bool next (Remote<Value> &x) {
+			scatter::Outcome o;
+			while (scatter::next (run, o)) {
+				if (o.ok) {
+					x = Remote<Value> (io::decode<Value> (o.value), o.host);
+					return true;
+				}
+				failed.push_back (std::make_pair (o.host, o.error));
+				if (policy == scatter::FailFast) throw o.error;
+			}
+			if (scatter::quorumLost (run)) throw scatter::QuorumLost ("Quorum lost: " + to_string (failed.size()) + " hosts failed");
+			return false;
+		}
+		/** Failures seen by `next` so far */
+		const std::vector< std::pair <Host, call::Exception> >& failures () const {return failed;}
+		/** Call no more hosts */
+		void cancel () {scatter::stop (run);}
+	};
+
+	/** Start evaluating action on each host, at most `options.concurrency` at a time, and return immediately. Calls carry the deadline and trace of the calling thread */
+	template <class O> Scatter<O> scatter (Function0<O> action, std::vector<Host> hosts, scatter::Options options = scatter::Options()) {
+		return Scatter<O> (scatter::start (action.closure, hosts, options), options.policy);
+	}
+
+	/** Wait for all results of scatter its policy lets through */
+	template <class O> Gathered<O> gather (Scatter<O> s) {
+		Gathered<O> g;
+		Remote <typename future::Slot<O>::type> x;
+		while (s.next (x)) g.results.push_back (x);
+		g.failures = s.failures();
+		return g;
+	}
+
+	/** Evaluate action on each host and wait for the results */
+	template <class O> Gathered<O> scatterGather (Function0<O> action, std::vector<Host> hosts, scatter::Options options = scatter::Options()) {
+		return gather (scatter (action, hosts, options));
+	}
+
+}
@@ -0,0 +1,163 @@
+#include "streaming.h"
+#include <stdexcept>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/tss.hpp>
+#include <10util/util.h> // to_string
+
+unsigned streaming::stallTimeout = 60;
+
+/** Where this thread's streamed call sends its chunks */
+struct Sink {
+	boost::function1 <void, std::string> send;
+	boost::shared_ptr<streaming::Credits> credits;
+	Sink (boost::function1 <void, std::string> send, boost::shared_ptr<streaming::Credits> credits) : send(send), credits(credits) {}
+};
+
+static boost::thread_specific_ptr<Sink> sink;
+
+void streaming::write (io::Code chunk) {
+	Sink* s = sink.get();
+	if (!s) throw std::runtime_error ("streaming::write outside a streamed call");
+	if (!s->credits->take()) throw std::runtime_error ("Stream closed by client");
+	s->send (chunk.data);
+}
+
+bool streaming::active () {
+	return sink.get() != 0;
+}
+
+void streaming::Credits::grant (long n) {
+	{
+		boost::lock_guard<boost::mutex> lock (mutex);
+		available += n;
+	}
+	granted.notify_all();
+}
+
+void streaming::Credits::close () {
+	{
+		boost::lock_guard<boost::mutex> lock (mutex);
+		closed = true;
+	}
+	granted.notify_all();
+}
+
+bool streaming::Credits::take () {
+	boost::system_time until = boost::get_system_time() + boost::posix_time::seconds (stallTimeout);
+	boost::unique_lock<boost::mutex> lock (mutex);
+	while (available <= 0 && !closed)
+		if (!granted.timed_wait (lock, until) && available <= 0 && !closed) throw std::runtime_error ("Client consumed no chunk for " + to_string (stallTimeout) + "s");
+	if (closed) return false;
+	available--;
+	return true;
+}
+
+boost::shared_ptr<streaming::Credits> streaming::Registry::open (boost::uint32_t id) {
+	boost::shared_ptr<Credits> credits (new Credits);
+	boost::lock_guard<boost::mutex> lock (mutex);
+	calls [id] = credits;
+	return credits;
+}
+
+void streaming::Registry::grant (boost::uint32_t id, long n) {
+	boost::shared_ptr<Credits> credits;
+	{
+		boost::lock_guard<boost::mutex> lock (mutex);
+		std::map < boost::uint32_t, boost::shared_ptr<Credits> >::iterator it = calls.find (id);
+		if (it == calls.end()) return;
+		credits = it->second;
+	}
+	if (n == 0) credits->close();
+	else credits->grant (n);
+}
+
+void streaming::Registry::close (boost::uint32_t id) {
+	boost::lock_guard<boost::mutex> lock (mutex);
+	calls.erase (id);
+}
+
+void streaming::Registry::closeAll () {
+	std::map < boost::uint32_t, boost::shared_ptr<Credits> > closing;
+	{
+		boost::lock_guard<boost::mutex> lock (mutex);
+		closing.swap (calls);
+	}
+	for (std::map < boost::uint32_t, boost::shared_ptr<Credits> >::iterator it = closing.begin(); it != closing.end(); ++it)
+		it->second->close();
+}
+
+streaming::Scope::Scope (boost::function1 <void, std::string> send, boost::shared_ptr<Credits> credits) {
+	sink.reset (new Sink (send, credits));
+}
+
+streaming::Scope::~Scope () {
+	sink.reset ();
+}
+
+void streaming::Queue::granting (boost::function1 <void, unsigned> grant) {
+	boost::lock_guard<boost::mutex> lock (mutex);
+	this->grant = grant;
+}
+
+void streaming::Queue::push (std::string chunk) {
+	{
+		boost::lock_guard<boost::mutex> lock (mutex);
+		if (cancelled) return;
+		chunks.push_back (std::string());
+		chunks.back().swap (chunk);
+	}
+	changed.notify_all();
+}
+
+void streaming::Queue::end () {
+	{
+		boost::lock_guard<boost::mutex> lock (mutex);
+		ended = true;
+	}
+	changed.notify_all();
+}
+
+/** Credits are granted in batches of half the window, so the server rarely runs dry while we still have chunks to consume */
+bool streaming::Queue::pop (std::string &chunk) {
+	boost::function1 <void, unsigned> g;
+	unsigned n = 0;
+	{
+		boost::unique_lock<boost::mutex> lock (mutex);
+		while (chunks.empty() && !ended) changed.wait (lock);
+		if (chunks.empty()) return false;
+		chunk.swap (chunks.front());
+		chunks.pop_front();
+		if (++consumed >= Window / 2 && !ended) {
+			n = consumed;
+			consumed = 0;
+			g = grant;
+		}
+	}
+	if (g) {
+		try {g (n);}
+		catch (std::exception &e) {} // connection closed, reader will end us
+	}
+	return true;
+}
+
+void streaming::Queue::cancel () {
+	boost::function1 <void, unsigned> g;
+	{
+		boost::lock_guard<boost::mutex> lock (mutex);
+		if (ended) return;
+		ended = true;
+		cancelled = true;
+		chunks.clear();
+		g = grant;
+	}
+	changed.notify_all();
+	if (g) {
+		try {g (0);}
+		catch (std::exception &e) {} // connection closed, which ends the call too
+	}
+}
+
+bool streaming::Queue::isCancelled () {
+	boost::lock_guard<boost::mutex> lock (mutex);
+	return cancelled;
+}
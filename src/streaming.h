@@ -0,0 +1,94 @@
+/* Results streamed in chunks while a remote function runs, instead of one response once it returns. The function `put`s each chunk as it is produced and the client takes them as they arrive, so neither end holds more than a window of chunks at a time.
+ * A streamed request is answered with Chunk frames, then its final Response or Error frame (see frame.h). The server sends at most `Window` chunks ahead of what the client has consumed; the client grants more with Credit frames as it consumes them, so a slow consumer blocks the producing function rather than piling chunks up in memory. A client that stops reading cancels the stream with a Credit of 0, and the function fails at its next `put`, as it does if the client consumes nothing for `stallTimeout`. */
+
+#pragma once
+
+#include <map>
+#include <deque>
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <10util/io.h>
+
+namespace streaming {
+
+	/** Chunks a server may send ahead of what the client has consumed */
+	const unsigned Window = 16;
+
+	/** Seconds a streamed call waits for the client to consume a chunk before failing. Default 60 */
+	extern unsigned stallTimeout;
+
+	/* Server */
+
+	/** Send chunk to the client of the streamed call this thread is running. Wait while client has Window chunks not consumed yet. Throw if this thread is not running a streamed call, client went away or cancelled the stream, or waited `stallTimeout` */
+	void write (io::Code chunk);
+
+	template <class T> void put (const T &x) {write (io::encode (x));}
+
+	/** Whether this thread is running a streamed call */
+	bool active ();
+
+	/** Chunks a streamed call may still send */
+	class Credits {
+		boost::mutex mutex;
+		boost::condition_variable granted;
+		long available;
+		bool closed;
+	public:
+		Credits () : available (Window), closed (false) {}
+		void grant (long n);
+		/** Wake writer and make it fail */
+		void close ();
+		/** Wait for a credit and take it. Return false if closed. Throw if none came within stallTimeout */
+		bool take ();
+	};
+
+	/** Credits of the streamed calls running on a connection */
+	class Registry {
+		boost::mutex mutex;
+		std::map < boost::uint32_t, boost::shared_ptr<Credits> > calls;
+	public:
+		boost::shared_ptr<Credits> open (boost::uint32_t id);
+		/** Ignored if call already finished. A grant of 0 cancels the call's stream */
+		void grant (boost::uint32_t id, long n);
+		void close (boost::uint32_t id);
+		/** Close all calls, on connection close */
+		void closeAll ();
+	};
+
+	/** While in scope, `write` on this thread sends chunks with `send` under flow control of credits */
+	class Scope {
+	public:
+		Scope (boost::function1 <void, std::string> send, boost::shared_ptr<Credits> credits);
+		~Scope ();
+	};
+
+	/* Client */
+
+	/** Chunks received for a streamed call, not consumed yet */
+	class Queue {
+		boost::mutex mutex;
+		boost::condition_variable changed;
+		std::deque<std::string> chunks;
+		bool ended;
+		bool cancelled;
+		unsigned consumed;  // since credits last granted
+		boost::function1 <void, unsigned> grant;
+	public:
+		Queue () : ended (false), cancelled (false), consumed (0) {}
+		/** Set function granting server more credits */
+		void granting (boost::function1 <void, unsigned> grant);
+		void push (std::string chunk);
+		/** No more chunks will be pushed */
+		void end ();
+		/** Wait for next chunk and swap it into `chunk`, granting server credits as chunks are consumed. Return false once ended and empty */
+		bool pop (std::string &chunk);
+		/** Drop chunks and tell server to stop producing them, unless ended already. Chunks still arriving are dropped */
+		void cancel ();
+		bool isCancelled ();
+	};
+
+}
@@ -0,0 +1,285 @@
+#include "stubcache.h"
+#include <10util/util.h> // to_string
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <boost/thread.hpp>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+static std::string envOr (const char* name, std::string def) {
+	const char* value = getenv (name);
+	return value ? std::string (value) : def;
+}
+
+/** Per user, as stubs found there are loaded into the process */
+static std::string defaultDirectory () {
+	const char* cache = getenv ("XDG_CACHE_HOME");
+	if (cache && *cache) return std::string (cache) + "/10remote-stubs";
+	return "/tmp/10remote-stubs-" + to_string (geteuid());
+}
+
+std::string stubcache::directory = envOr ("STUB_CACHE_DIR", defaultDirectory());
+unsigned long long stubcache::capacity = 0;
+
+static const unsigned long long DefaultCapacity = 256ull << 20;
+
+/** $STUB_CACHE_SIZE, or DefaultCapacity if it is not set or not a number. Read on first eviction rather than at startup, so a bad value only warns */
+static unsigned long long environmentCapacity;
+static boost::once_flag environmentCapacityOnce = BOOST_ONCE_INIT;
+static void initEnvironmentCapacity () {
+	environmentCapacity = DefaultCapacity;
+	const char* value = getenv ("STUB_CACHE_SIZE");
+	if (!value || !*value) return;
+	char* end;
+	errno = 0;
+	unsigned long long n = strtoull (value, &end, 10);
+	if (*end || errno || n == 0 || *value == '-') std::cerr << "Ignoring STUB_CACHE_SIZE=" << value << ", not a positive number of bytes" << std::endl;
+	else environmentCapacity = n;
+}
+
+/** Name of function exported by each stub that returns its new object */
+static const char* Symbol = "remote_stub";
+
+std::string stubcache::hash (const std::string &s) {
+	unsigned long long h = 14695981039346656037ULL;
+	for (size_t i = 0; i < s.size(); i++) {
+		h ^= (unsigned char) s[i];
+		h *= 1099511628211ULL;
+	}
+	char hex [17];
+	snprintf (hex, sizeof hex, "%016llx", h);
+	return hex;
+}
+
+static std::string compiler () {return envOr ("CXX", "g++");}
+
+/** Compiler name and its version banner, so stubs are not reused across compiler upgrades */
+static std::string compilerIdentity;
+static boost::once_flag compilerIdentityOnce = BOOST_ONCE_INIT;
+static void initCompilerIdentity () {
+	compilerIdentity = compiler();
+	FILE* p = popen ((compiler() + " --version 2>&1").c_str(), "r");
+	if (!p) return;
+	char buf [256];
+	size_t n;
+	while ((n = fread (buf, 1, sizeof buf, p)) > 0) compilerIdentity.append (buf, n);
+	pclose (p);
+}
+
+/** Append "path size mtime" to out if path exists */
+static bool fileVersion (std::string path, std::ostream &out) {
+	struct stat st;
+	if (stat (path.c_str(), &st) != 0) return false;
+	out << path << " " << st.st_size << " " << st.st_mtime << "\n";
+	return true;
+}
+
+/** Name inside <> or "" of an #include line, or empty if not an #include line */
+static std::string includedName (std::string line) {
+	size_t i = line.find_first_not_of (" \t");
+	if (i == std::string::npos || line.compare (i, 8, "#include") != 0) return "";
+	size_t start = line.find_first_of ("<\"", i + 8);
+	if (start == std::string::npos) return "";
+	size_t end = line.find_first_of (">\"", start + 1);
+	if (end == std::string::npos) return "";
+	return line.substr (start + 1, end - start - 1);
+}
+
+/** Versions of headers included by ctx that are found in its include paths, and of libraries it links. System headers are covered by the compiler identity */
+static std::string dependencies (const compile::LinkContext &ctx) {
+	std::stringstream out;
+	std::vector<std::string> includePaths = ctx.includePaths;
+	includePaths.push_back (".");
+	for (unsigned h = 0; h < ctx.headers.size(); h++) {
+		std::istringstream lines (ctx.headers[h]);
+		std::string line;
+		while (std::getline (lines, line)) {
+			std::string name = includedName (line);
+			if (name.empty()) continue;
+			for (unsigned i = 0; i < includePaths.size(); i++)
+				if (fileVersion (includePaths[i] + "/" + name, out)) break;
+		}
+	}
+	for (unsigned l = 0; l < ctx.libNames.size(); l++)
+		for (unsigned i = 0; i < ctx.libPaths.size(); i++)
+			if (fileVersion (ctx.libPaths[i] + "/lib" + ctx.libNames[l] + ".so", out)) break;
+	return out.str();
+}
+
+static std::string readFile (std::string path) {
+	std::ifstream in (path.c_str());
+	std::stringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+static void writeFile (std::string path, const std::string &content) {
+	std::ofstream out (path.c_str());
+	out << content;
+	if (!out) throw std::runtime_error ("Cannot write " + path);
+}
+
+/** Create path if missing, private to this user. Raise if it belongs to another user or others can write to it, since stubs in it are loaded as code */
+static void makeDirectory (std::string path) {
+	for (size_t i = 1; i <= path.size(); i++)
+		if (i == path.size() || path[i] == '/')
+			if (mkdir (path.substr (0, i) .c_str(), 0700) != 0 && errno != EEXIST)
+				throw std::runtime_error ("Cannot create stub cache directory " + path.substr (0, i));
+	struct stat st;
+	if (lstat (path.c_str(), &st) != 0 || !S_ISDIR (st.st_mode))
+		throw std::runtime_error ("Stub cache " + path + " is not a directory");
+	if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+		throw std::runtime_error ("Stub cache directory " + path + " must be owned by this user and not writable by others");
+}
+
+/** Exclusive advisory lock on a file, held for lifetime of this object. Serializes processes sharing the cache directory */
+class FileLock {
+	int fd;
+public:
+	FileLock (std::string path, bool shared = false) : fd (open (path.c_str(), O_RDWR | O_CREAT, 0600)) {
+		if (fd < 0) throw std::runtime_error ("Cannot open lock file " + path);
+		while (flock (fd, shared ? LOCK_SH : LOCK_EX) != 0)
+			if (errno != EINTR) {
+				int error = errno;
+				close (fd);
+				throw std::runtime_error ("Cannot lock " + path + ": " + strerror (error));
+			}
+	}
+	~FileLock () {
+		flock (fd, LOCK_UN);
+		close (fd);
+	}
+};
+
+/** Stub at base was compiled from key. Comparing the full key guards against hash collisions */
+static bool isCached (std::string base, const std::string &key) {
+	return access ((base + ".so") .c_str(), R_OK) == 0 && readFile (base + ".key") == key;
+}
+
+static std::string temporaryName (std::string path) {
+	std::stringstream tag;
+	tag << path << "." << getpid() << "-" << boost::this_thread::get_id() << ".tmp";
+	return tag.str();
+}
+
+void stubcache::build (const compile::LinkContext &ctx, const std::string &src, std::string path) {
+	std::string tmp = temporaryName (path);
+	writeFile (tmp + ".cpp", src);
+	std::stringstream cmd;
+	cmd << compiler() << " -shared -fPIC -rdynamic -o " << tmp << ".so " << tmp << ".cpp";
+	for (unsigned i = 0; i < ctx.includePaths.size(); i++) cmd << " -I" << ctx.includePaths[i];
+	for (unsigned i = 0; i < ctx.libPaths.size(); i++) cmd << " -L" << ctx.libPaths[i];
+	for (unsigned i = 0; i < ctx.libNames.size(); i++) cmd << " -l" << ctx.libNames[i];
+	cmd << " 2> " << tmp << ".err";
+	int status = system (cmd.str() .c_str());
+	std::string errors = readFile (tmp + ".err");
+	remove ((tmp + ".cpp") .c_str());
+	remove ((tmp + ".err") .c_str());
+	if (status != 0) {
+		remove ((tmp + ".so") .c_str());
+		throw std::runtime_error ("Failed to compile stub: " + cmd.str() + "\n" + errors);
+	}
+	if (rename ((tmp + ".so") .c_str(), path.c_str()) != 0) throw std::runtime_error ("Cannot create " + path);
+}
+
+/** Compile src into base.so and record its key */
+static void compileTo (const compile::LinkContext &ctx, const std::string &src, const std::string &key, std::string base) {
+	std::string tmp = temporaryName (base);
+	writeFile (tmp + ".key", key);
+	rename ((tmp + ".key") .c_str(), (base + ".key") .c_str());
+	stubcache::build (ctx, src, base + ".so");
+}
+
+std::string stubcache::source (const compile::LinkContext &ctx, std::string type, std::string expression) {
+	std::stringstream ss;
+	for (unsigned i = 0; i < ctx.headers.size(); i++) ss << ctx.headers[i] << "\n";
+	ss << "extern \"C\" void* " << Symbol << " () {return new " << type << " (" << expression << ");}\n";
+	return ss.str();
+}
+
+static void evictExcept (std::string keep);
+
+void* stubcache::load (const compile::LinkContext &ctx, std::string type, std::string expression) {
+	boost::call_once (initCompilerIdentity, compilerIdentityOnce);
+	std::string src = source (ctx, type, expression);
+	std::string key = src + "\n" + compilerIdentity + "\n" + dependencies (ctx);
+	std::string base = directory + "/" + stubcache::hash (key);
+	std::string so = base + ".so";
+	bool compiled = false;
+	void* lib;
+	makeDirectory (directory);
+	{
+		FileLock inUse (directory + "/.evict.lock", true); // stub is not evicted before it is loaded
+		if (!isCached (base, key)) {
+			FileLock lock (base + ".lock"); // another process compiling the same stub finishes before we check again
+			if (!isCached (base, key)) {
+				compileTo (ctx, src, key, base);
+				compiled = true;
+			}
+		}
+		utime (so.c_str(), 0); // mark recently used for eviction
+		lib = dlopen (so.c_str(), RTLD_NOW | RTLD_LOCAL); // local, so stubs do not resolve each other's symbols
+	}
+	if (!lib) throw std::runtime_error ("Cannot load stub " + so + ": " + dlerror());
+	if (compiled) evictExcept (base);
+	void* (*make) () = (void* (*) ()) dlsym (lib, Symbol);
+	if (!make) throw std::runtime_error ("Stub " + so + " missing " + Symbol);
+	return make ();
+}
+
+struct CachedStub {
+	std::string base;
+	off_t size;
+	time_t used;
+	CachedStub (std::string base, off_t size, time_t used) : base(base), size(size), used(used) {}
+};
+
+static bool usedBefore (const CachedStub &a, const CachedStub &b) {return a.used < b.used;}
+
+void stubcache::evict () {evictExcept ("");}
+
+/** Delete least recently used stubs other than keep until total size is within capacity. A process that already loaded an evicted stub keeps using it */
+static void evictExcept (std::string keep) {
+	std::string directory = stubcache::directory;
+	unsigned long long capacity = stubcache::capacity;
+	if (capacity == 0) {
+		boost::call_once (initEnvironmentCapacity, environmentCapacityOnce);
+		capacity = environmentCapacity;
+	}
+	makeDirectory (directory);
+	FileLock lock (directory + "/.evict.lock");
+	DIR* dir = opendir (directory.c_str());
+	if (!dir) return;
+	std::vector<CachedStub> stubs;
+	unsigned long long total = 0;
+	while (struct dirent* entry = readdir (dir)) {
+		std::string name = entry->d_name;
+		if (name.size() != 19 || name.compare (16, 3, ".so") != 0) continue; // skip temporary and lock files
+		std::string base = directory + "/" + name.substr (0, 16);
+		struct stat st;
+		if (stat ((base + ".so") .c_str(), &st) != 0) continue;
+		stubs.push_back (CachedStub (base, st.st_size, st.st_mtime));
+		total += st.st_size;
+	}
+	closedir (dir);
+	std::sort (stubs.begin(), stubs.end(), usedBefore);
+	for (unsigned i = 0; i < stubs.size() && total > capacity; i++) {
+		if (stubs[i].base == keep) continue;
+		remove ((stubs[i].base + ".so") .c_str());
+		remove ((stubs[i].base + ".key") .c_str());
+		total -= stubs[i].size;
+	}
+}
@@ -0,0 +1,39 @@
+/* Persistent on-disk cache of compiled function stubs, so a restarted server does not have to run the compiler again for functions it has seen before.
+ * A stub is addressed by a hash of its generated source, the versions (size and modification time) of the headers and libraries it depends on, and the identity of the compiler. The cache directory may be shared by several processes of the same user. Stubs are loaded with their own symbols kept local, so they never bind to another stub's. */
+
+#pragma once
+
+#include <10util/compile.h>
+#include <boost/shared_ptr.hpp>
+#include <string>
+
+namespace stubcache {
+
+	/** Directory holding compiled stubs. Defaults to $STUB_CACHE_DIR, or $XDG_CACHE_HOME/10remote-stubs, or /tmp/10remote-stubs-<uid>. Must belong to this user and not be writable by others */
+	extern std::string directory;
+
+	/** Max total bytes of compiled stubs kept in directory. Least recently used stubs are evicted beyond this. 0 (the default) takes $STUB_CACHE_SIZE, or 256MB if it is not set or not a number */
+	extern unsigned long long capacity;
+
+	/** Source of translation unit that defines `expression` of given `type` in ctx and exports it to `load` */
+	std::string source (const compile::LinkContext &ctx, std::string type, std::string expression);
+
+	/** 64-bit FNV-1a hash of s in hex */
+	std::string hash (const std::string &s);
+
+	/** Compile src with ctx's include paths and libraries into shared library at path. Writes to a temporary file first so other processes never see a partial library */
+	void build (const compile::LinkContext &ctx, const std::string &src, std::string path);
+
+	/** Return new object of given type evaluated from expression in ctx. Loaded from directory if already compiled, otherwise compiled into directory first */
+	void* load (const compile::LinkContext &ctx, std::string type, std::string expression);
+
+	/** Same as compile::eval except result is cached on disk. `type` must be the C++ spelling of F */
+	template <class F> F eval (const compile::LinkContext &ctx, std::string type, std::string expression) {
+		boost::shared_ptr<F> f (static_cast<F*> (load (ctx, type, expression)));
+		return *f;
+	}
+
+	/** Delete least recently used stubs until total size is within capacity */
+	void evict ();
+
+}
@@ -2,9 +2,20 @@
 #include "thread.h"
 #include <10util/vector.h> // fmap
 
+const module::Module _thread::module (items<std::string>("10remote", "10util"), "10remote/thread.h");
+
+static void runTraced (trace::Context traced, remote::Function0<void> action) {
+	trace::Adopt scope (traced);
+	action ();
+}
+
+thread::Thread _thread::fork (remote::Function0<void> action, std::string desc) {
+	return thread::fork (boost::bind (runTraced, trace::current(), action), desc);
+}
+
 /** Fork thread on host to execute action. */
 remote::Thread remote::fork (Function0<void> action, std::string desc, Host host) {
-	return evalR (bind (MFUNT(thread,fork,remote::Function0), action, desc), host);
+	return evalR (bind (MFUN(_thread,fork), action, desc), host);
 }
 
 /** Kill thread */
@@ -15,8 +26,15 @@ void remote::interruptAll (std::vector<Thread> ts) {for (unsigned i = 0; i < ts.
 /** Wait for thread to complete */
 void remote::join (Thread t) {apply (MFUN(thread,join), t);}
 
+static void evalIn (trace::Context traced, deadline::Context timed, remote::Function0<void> action, remote::Host host) {
+	trace::Adopt tracing (traced);
+	deadline::Adopt timing (timed);
+	remote::eval (action, host);
+}
+
+/** Action evaluating on its host, under this thread's trace and deadline */
 static boost::function0<void> remoteEval (std::pair< remote::Function0<void>, remote::Host > x) {
-	return boost::bind (remote::eval<void>, x.first, x.second);
+	return boost::bind (evalIn, trace::current(), deadline::current(), x.first, x.second);
 }
 
 /** Fork actions on associated hosts; wait for control actions to finish then terminate continuous actions. If one action fails then terminate all other actions and rethrow failure in main thread */
@@ -7,11 +7,20 @@
 #include <10util/thread.h>
 #include "remote.h"
 
+namespace _thread {
+
+	extern const module::Module module;
+
+	/** Fork thread to execute action in the trace of this thread (see trace.h). What remote::fork runs on host */
+	thread::Thread fork (remote::Function0<void> action, std::string description);
+
+}
+
 namespace remote {
 
 	typedef remote::Remote<thread::Thread> Thread;
 
-	/** Fork thread on host to execute action */
+	/** Fork thread on host to execute action. Calls it makes join the trace of the caller */
 	Thread fork (Function0<void> action, std::string description, Host host);
 
 	/** Wait for thread to complete */
@@ -22,7 +31,7 @@ namespace remote {
 
 	void interruptAll (std::vector<Thread> ts);
 
-	/** Fork actions on associated hosts and wait for control actions to finish then terminate continuous actions. If one action fails then terminate all actions and rethrow failure in main thread */
+	/** Fork actions on associated hosts and wait for control actions to finish then terminate continuous actions. Calls run under the caller's trace and deadline. If one action fails then terminate all actions and rethrow failure in main thread */
 	void parallel (std::vector< std::pair<Function0<void>,Host> > controlActions, std::vector< std::pair<Function0<void>,Host> > continuousActions);
 
 }
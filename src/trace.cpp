@@ -0,0 +1,240 @@
+#include "trace.h"
+#include "metrics.h"
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <time.h>
+#include <unistd.h>
+#include <boost/thread/once.hpp>
+#include <boost/thread/tss.hpp>
+
+bool trace::enabled = false;
+unsigned trace::capacity = 4096;
+
+trace::Span::Span () : traceId(0), spanId(0), parentId(0), server(false), error(false), start(0), duration(0), queued(0) {
+	for (unsigned p = 0; p < metrics::Phases; p++) phases[p] = 0;
+}
+
+static long long micros (clockid_t clock) {
+	struct timespec t;
+	clock_gettime (clock, &t);
+	return (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/** Random looking, never 0 */
+static boost::uint64_t newId () {
+	static boost::uint64_t base = (boost::uint64_t) micros (CLOCK_REALTIME) << 20 ^ (boost::uint64_t) getpid();
+	static boost::uint64_t count = 0;
+	boost::uint64_t z = base + __sync_add_and_fetch (&count, 1) * 0x9e3779b97f4a7c15ULL; // splitmix64
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z ^= z >> 31;
+	return z == 0 ? 1 : z;
+}
+
+/* Ring buffer */
+
+/** Span in the ring. Writers bump seq to odd before writing and to even after, so readers can tell a slot they copied mid-write */
+struct Slot {
+	volatile unsigned seq;
+	unsigned long index;  // of span recorded in slot
+	boost::uint64_t traceId, spanId, parentId;
+	bool server, error;
+	char name [64], host [64];
+	long long start, duration, queued, phases [metrics::Phases];
+};
+
+static Slot* ring;
+static unsigned ringSize;
+static unsigned long recorded = 0;  // spans ever recorded
+static boost::once_flag ringOnce = BOOST_ONCE_INIT;
+
+static void allocate () {
+	ringSize = std::max (1u, trace::capacity);
+	ring = new Slot [ringSize];
+	memset (ring, 0, sizeof (Slot) * ringSize);
+}
+
+static void copy (char* to, const std::string &from, size_t size) {
+	strncpy (to, from.c_str(), size - 1);
+	to [size - 1] = 0;
+}
+
+static void record (const trace::Span &span) {
+	boost::call_once (allocate, ringOnce);
+	unsigned long i = __sync_fetch_and_add (&recorded, 1);
+	Slot &s = ring [i % ringSize];
+	__sync_fetch_and_add (&s.seq, 1);
+	__sync_synchronize();
+	s.index = i;
+	s.traceId = span.traceId;
+	s.spanId = span.spanId;
+	s.parentId = span.parentId;
+	s.server = span.server;
+	s.error = span.error;
+	copy (s.name, span.name, sizeof s.name);
+	copy (s.host, span.host, sizeof s.host);
+	s.start = span.start;
+	s.duration = span.duration;
+	s.queued = span.queued;
+	for (unsigned p = 0; p < metrics::Phases; p++) s.phases[p] = span.phases[p];
+	__sync_synchronize();
+	__sync_fetch_and_add (&s.seq, 1);
+}
+
+/** Copy of slot holding span i, or false if it was overwritten or is being written */
+static bool read (unsigned long i, trace::Span &span) {
+	const Slot &s = ring [i % ringSize];
+	unsigned seq = s.seq;
+	__sync_synchronize();
+	if (seq % 2 != 0 || s.index != i) return false;
+	span.traceId = s.traceId;
+	span.spanId = s.spanId;
+	span.parentId = s.parentId;
+	span.server = s.server;
+	span.error = s.error;
+	span.name = s.name;
+	span.host = s.host;
+	span.start = s.start;
+	span.duration = s.duration;
+	span.queued = s.queued;
+	for (unsigned p = 0; p < metrics::Phases; p++) span.phases[p] = s.phases[p];
+	__sync_synchronize();
+	return s.seq == seq;
+}
+
+std::vector<trace::Span> trace::spans () {
+	boost::call_once (allocate, ringOnce);
+	std::vector<Span> spans;
+	unsigned long end = __sync_fetch_and_add (&recorded, 0);
+	for (unsigned long i = end > ringSize ? end - ringSize : 0; i < end; i++) {
+		Span span;
+		if (read (i, span)) spans.push_back (span);
+	}
+	return spans;
+}
+
+void trace::dump (std::string path) {
+	std::ofstream out (path.c_str());
+	std::vector<Span> ss = spans();
+	for (unsigned i = 0; i < ss.size(); i++) out << ss[i] << "\n";
+	if (!out) throw std::runtime_error ("Cannot write spans to " + path);
+}
+
+/* Context */
+
+/** Trace of call this thread is serving, or of the thread that started it (see Adopt) */
+static boost::thread_specific_ptr<trace::Context> context;
+static boost::thread_specific_ptr<long long> queuedFor;
+
+trace::Context trace::current () {
+	return context.get() ? *context : Context();
+}
+
+static void setContext (const trace::Context &c) {
+	if (c.traceId == 0) context.reset();
+	else context.reset (new trace::Context (c));
+}
+
+trace::Adopt::Adopt (Context c) : saved (current()) {setContext (c);}
+
+trace::Adopt::~Adopt () {setContext (saved);}
+
+/* Client */
+
+trace::Client::Client (std::string name, std::string host) : started (micros (CLOCK_MONOTONIC)) {
+	trace::Context* c = context.get();
+	if (c) {
+		span.traceId = c->traceId;
+		span.parentId = c->spanId;
+	} else if (enabled)
+		span.traceId = newId();
+	else
+		return;
+	span.spanId = newId();
+	span.name = name;
+	span.host = host;
+	span.start = micros (CLOCK_REALTIME);
+}
+
+/** Traced request is '^' trace id '.' span id '\n' request, ids in hex */
+io::Code trace::Client::request (const io::Code &request) const {
+	if (!traced()) return request;
+	std::ostringstream out;
+	out << '^' << std::hex << span.traceId << '.' << span.spanId << '\n';
+	return io::Code (out.str() + request.data);
+}
+
+void trace::Client::finish (bool error) {
+	if (!traced()) return;
+	span.duration = micros (CLOCK_MONOTONIC) - started;
+	span.error = error;
+	record (span);
+}
+
+/* Server */
+
+bool trace::isTraced (const io::Code &request) {
+	return !request.data.empty() && request.data[0] == '^';
+}
+
+/** Threads serve one call at a time, so a call's context replaces any other */
+trace::Server::Server (io::Code &request, std::string host) : started (micros (CLOCK_MONOTONIC)) {
+	size_t end = request.data.find ('\n');
+	std::istringstream in (request.data.substr (1, end == std::string::npos ? 0 : end - 1));
+	char dot = 0;
+	in >> std::hex >> span.traceId >> dot >> span.parentId;
+	if (end == std::string::npos || !in || dot != '.') throw std::runtime_error ("Corrupt trace context");
+	request.data.erase (0, end + 1);
+	span.spanId = newId();
+	span.server = true;
+	span.host = host;
+	span.start = micros (CLOCK_REALTIME);
+	if (queuedFor.get()) {
+		span.queued = *queuedFor;
+		*queuedFor = 0;
+	}
+	context.reset (new trace::Context (span.traceId, span.spanId));
+	metrics::lastCall (span.name, span.phases); // forget call served before, so a request not calling a function is not named after it
+	span.name.clear();
+	for (unsigned p = 0; p < metrics::Phases; p++) span.phases[p] = 0;
+}
+
+trace::Server::~Server () {
+	context.reset();
+	span.duration = micros (CLOCK_MONOTONIC) - started;
+	span.error = std::uncaught_exception();
+	metrics::lastCall (span.name, span.phases);
+	record (span);
+}
+
+void trace::queued (long long micros) {
+	if (!queuedFor.get()) queuedFor.reset (new long long);
+	*queuedFor = micros;
+}
+
+bool trace::isSpansRequest (const io::Code &request) {
+	return request.data == "?trace";
+}
+
+io::Code trace::reply (const io::Code &request) {
+	return io::encode (spans());
+}
+
+io::Code trace::request () {
+	return io::Code ("?trace");
+}
+
+std::ostream& operator<< (std::ostream& out, const trace::Span &s) {
+	out << std::hex << s.traceId << " " << s.spanId << " " << s.parentId << std::dec << " " << (s.server ? "serve " : "call ") << s.name << " " << s.host
+		<< " start " << s.start << " duration " << s.duration << "us";
+	if (s.server) {
+		out << " queued " << s.queued << "us";
+		for (unsigned p = 0; p < metrics::Phases; p++) out << " " << metrics::phaseName ((metrics::Phase) p) << " " << s.phases[p] << "us";
+	}
+	if (s.error) out << " error";
+	return out;
+}
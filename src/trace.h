@@ -0,0 +1,131 @@
+/* Tracing of calls across hosts. A traced request carries its trace id and the span of the call that sent it, and a server serving it runs the function with that trace as the current one of its thread, so calls the function makes join the same trace. Each process records a span per call made and served in a ring buffer, which can be dumped to a file or fetched from another host with `remote::traces`.
+ * A client span covers a whole call as the caller saw it: connecting, sending, waiting on the server and receiving. A server span covers serving it, split into time queued for a worker and the decode, lookup (or compile), execute and encode phases of metrics.h. Time in a client span not covered by its server span is spent on the network and in the server's socket. */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+#include <10util/io.h>
+#include "phase.h"
+
+namespace trace {
+
+	/** Start a new trace for calls made outside any trace. Calls made while serving a traced call are always traced. Default false */
+	extern bool enabled;
+
+	/** Spans kept, oldest overwritten first. Set before first span is recorded. Default 4096 */
+	extern unsigned capacity;
+
+	struct Span {
+		boost::uint64_t traceId;
+		boost::uint64_t spanId;
+		boost::uint64_t parentId;  // span of the call this one is part of, 0 for first of trace
+		bool server;  // served a call, else made one
+		bool error;  // call raised an exception
+		std::string name;  // of function called
+		std::string host;  // called, or serving
+		long long start;  // microseconds since epoch
+		long long duration;  // microseconds
+		long long queued;  // microseconds waiting for a worker, server only
+		long long phases [metrics::Phases];  // microseconds, server only
+		Span ();
+	};
+
+	/** Spans recorded by this process, oldest first */
+	std::vector<Span> spans ();
+
+	/** Write spans to file, one per line */
+	void dump (std::string path);
+
+	/** Trace of the call a thread is serving, to carry to threads it starts */
+	struct Context {
+		boost::uint64_t traceId, spanId;  // 0 if none
+		Context (boost::uint64_t traceId, boost::uint64_t spanId) : traceId(traceId), spanId(spanId) {}
+		Context () : traceId(0), spanId(0) {}
+	};
+
+	/** Trace of the call this thread is serving, if any */
+	Context current ();
+
+	/** Calls made by this thread while in scope join context's trace, as if made by the thread it was taken from */
+	class Adopt {
+		Context saved;  // of this thread before scope
+		Adopt (const Adopt&);  // not copyable
+		void operator= (const Adopt&);
+	public:
+		Adopt (Context);
+		~Adopt ();
+	};
+
+	/* Client */
+
+	/** Times a call made by this thread while in scope. Call is traced if thread is serving a traced call or tracing is enabled */
+	class Client {
+		Span span;
+		long long started;
+		Client (const Client&);  // not copyable
+		void operator= (const Client&);
+	public:
+		Client (std::string name, std::string host);
+		bool traced () const {return span.traceId != 0;}
+		/** Request prefixed with trace context, if traced */
+		io::Code request (const io::Code &request) const;
+		/** Record span, as failed if error */
+		void finish (bool error);
+	};
+
+	/* Server */
+
+	/** Whether request carries a trace context */
+	bool isTraced (const io::Code &request);
+
+	/** Makes the request's trace current on this thread while serving it, and records its span */
+	class Server {
+		Span span;
+		long long started;
+		Server (const Server&);  // not copyable
+		void operator= (const Server&);
+	public:
+		/** Strip trace context off request */
+		Server (io::Code &request, std::string host);
+		~Server ();
+	};
+
+	/** Set time the request about to be served on this thread waited for a worker */
+	void queued (long long micros);
+
+	/** Whether request asks for this process's spans */
+	bool isSpansRequest (const io::Code &request);
+
+	/** Spans encoded */
+	io::Code reply (const io::Code &request);
+
+	/** Request for a server's spans */
+	io::Code request ();
+
+}
+
+/* Printing & Serialization */
+
+std::ostream& operator<< (std::ostream&, const trace::Span&);
+
+namespace boost {namespace serialization {
+
+template <class Archive> void serialize (Archive & ar, trace::Span & x, const unsigned version) {
+	ar & x.traceId;
+	ar & x.spanId;
+	ar & x.parentId;
+	ar & x.server;
+	ar & x.error;
+	ar & x.name;
+	ar & x.host;
+	ar & x.start;
+	ar & x.duration;
+	ar & x.queued;
+	ar & x.phases;
+}
+
+}}
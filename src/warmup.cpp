@@ -0,0 +1,108 @@
+#include "warmup.h"
+#include <set>
+#include <deque>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+const module::Module warmup::module (items<std::string>("10remote", "10util"), "10remote/warmup.h");
+
+unsigned warmup::jobs = std::max (1u, boost::thread::hardware_concurrency());
+
+/** Functions queued by one call of `load`, completed when the last of them is loaded */
+struct Batch {
+	unsigned remaining;
+	std::string error;  // first compile error
+	boost::promise<void> done;
+	Batch (unsigned remaining) : remaining(remaining) {}
+};
+
+struct Job {
+	remote::FunctionId fun;
+	boost::shared_ptr<Batch> batch;
+	Job (remote::FunctionId fun, boost::shared_ptr<Batch> batch) : fun(fun), batch(batch) {}
+	Job () {}
+};
+
+static boost::mutex queueMutex;
+static boost::condition_variable queued;
+static std::deque<Job> queue;
+static unsigned workers = 0;
+
+static void finish (boost::shared_ptr<Batch> batch, std::string error) {
+	boost::unique_lock<boost::mutex> lock (queueMutex);
+	if (batch->error.empty()) batch->error = error;
+	if (--batch->remaining > 0) return;
+	if (batch->error.empty()) batch->done.set_value ();
+	else batch->done.set_exception (boost::copy_exception (std::runtime_error (batch->error)));
+}
+
+/** Compile queued stubs forever. Loading through getFunction0c means a stub already being compiled for a request is not compiled twice */
+static void work () {
+	for (;;) {
+		Job job;
+		{
+			boost::unique_lock<boost::mutex> lock (queueMutex);
+			while (queue.empty()) queued.wait (lock);
+			job = queue.front();
+			queue.pop_front();
+		}
+		std::string error;
+		try {_function::getFunction0c (job.fun);}
+		catch (std::exception &e) {error = e.what();}
+		finish (job.batch, error);
+	}
+}
+
+boost::shared_future<void> warmup::load (std::vector<remote::FunctionId> funs) {
+	std::set<remote::FunctionId> unique (funs.begin(), funs.end());
+	boost::shared_ptr<Batch> batch (new Batch (unique.size()));
+	boost::shared_future<void> future (batch->done.get_future());
+	if (unique.empty()) {
+		batch->done.set_value ();
+		return future;
+	}
+	boost::unique_lock<boost::mutex> lock (queueMutex);
+	for (std::set<remote::FunctionId>::iterator it = unique.begin(); it != unique.end(); ++it)
+		queue.push_back (Job (*it, batch));
+	for (; workers < jobs && workers < queue.size(); workers++)
+		boost::thread _th (work);
+	queued.notify_all ();
+	return future;
+}
+
+void warmup::loadAll (std::vector<remote::FunctionId> funs) {
+	load (funs) .get();
+}
+
+static std::vector<remote::FunctionId> funIds (const std::vector<remote::Closure> &closures) {
+	std::vector<remote::FunctionId> funs;
+	for (unsigned i = 0; i < closures.size(); i++) funs.push_back (closures[i].fun);
+	return funs;
+}
+
+boost::shared_future<void> remote::prepare (std::vector<Closure> closures) {
+	return warmup::load (funIds (closures));
+}
+
+/** Complete prepare of host with its reply. Runs on the thread that received it */
+static void prepared (boost::shared_ptr< boost::promise<void> > done, future::Future<io::Code> reply) {
+	try {
+		reply.get();
+		done->set_value ();
+	} catch (std::exception &e) {
+		done->set_exception (boost::copy_exception (std::runtime_error (e.what())));
+	}
+}
+
+boost::shared_future<void> remote::prepare (Host host, std::vector<Closure> closures) {
+	boost::shared_ptr< boost::promise<void> > done (new boost::promise<void>);
+	boost::shared_future<void> result (done->get_future());
+	try {
+		future::Future<io::Code> reply = remote::_evalAsync (remote::bind (MFUN(warmup,loadAll), funIds (closures)) .closure, host, executor::Bulk);
+		reply.onReady (boost::bind (prepared, done, reply));
+	} catch (std::exception &e) { // eg. could not connect
+		done->set_exception (boost::copy_exception (std::runtime_error (e.what())));
+	}
+	return result;
+}
@@ -0,0 +1,32 @@
+/* Compile function stubs in the background before they are called, so the first call of a function does not wait on the compiler. Stubs are compiled by a bounded pool of parallel compiler jobs, so warming many functions takes about as long as the slowest one. */
+
+#pragma once
+
+#include <vector>
+#include <boost/thread/future.hpp>
+#include "remote.h"
+
+namespace warmup {
+
+	extern const module::Module module;
+
+	/** Max number of stubs compiled in parallel. Defaults to number of cores */
+	extern unsigned jobs;
+
+	/** Queue stubs of functions to be compiled and loaded, and return immediately. Future completes when all are loaded, or holds the first compile error */
+	boost::shared_future<void> load (std::vector<remote::FunctionId>);
+
+	/** Same as `load` but wait for completion */
+	void loadAll (std::vector<remote::FunctionId>);
+
+}
+
+namespace remote {
+
+	/** Load stubs of closures' functions on this machine in the background. See warmup::load */
+	boost::shared_future<void> prepare (std::vector<Closure>);
+
+	/** Load stubs of closures' functions on host in the background, and return immediately. Takes no thread while host loads them. Future completes when host has loaded all of them */
+	boost::shared_future<void> prepare (Host, std::vector<Closure>);
+
+}
@@ -1,10 +1,15 @@
-/* Echo client and server */
+/* Echo client and server, and load generator */
 /* Assumes util and remote library has been built and installed in /usr/local/include and /usr/local/lib.
  * Compile as: g++ remote.cpp -o remote -I/opt/local/include -L/opt/local/lib -l10remote -l10util -lboost_system-mt -lboost_thread-mt -lboost_serialization-mt
- * Run as: `remote server <port>` and `remote client <hostname>:<port>` */
+ * Run as: `remote server <port>` and `remote client <hostname>:<port>`, or
+ *   `remote load <hostname>:<port> [-c concurrency] [-qps rate] [-d seconds] [-b payload-bytes] [-w spin-micros] [-mix bounce=8,length=1,spin=1]`
+ * Load runs closed loop (each of `concurrency` threads calls again as soon as its call returns) unless given a target rate, in which case calls are sent on a fixed schedule by `concurrency` threads (open loop). Latency is reported as measured, and corrected for coordinated omission: from when each call should have been sent, so a stalled server is not hidden by the load generator waiting on it. */
 
 #include <iostream>
 #include <utility>
+#include <algorithm>
+#include <cstdio>
+#include <time.h>
 #include <10util/util.h>
 #include <10remote/remote.h>
 
@@ -15,14 +20,35 @@ static string echo (string req) {
 	return req;
 }
 
+/* Functions of load mix */
+
+static string bounce (string req) {return req;}
+
+static unsigned length (string req) {return req.size();}
+
+/** Burn micros of server CPU */
+static unsigned spin (string req, unsigned micros) {
+	struct timespec t, u;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	unsigned n = 0;
+	do {
+		n++;
+		clock_gettime (CLOCK_MONOTONIC, &u);
+	} while ((u.tv_sec - t.tv_sec) * 1000000 + (u.tv_nsec - t.tv_nsec) / 1000 < micros);
+	return n + req.size();
+}
+
 const module::Module echo_module (".", ".", items<string>("10remote", "10util", "boost_thread-mt"), "remote.cpp");
+const module::Module bounce_module = echo_module;
+const module::Module length_module = echo_module;
+const module::Module spin_module = echo_module;
 
 void mainClient (remote::Host server) {
 	string line;
 	while (getline (cin, line)) {
 		try {
 			cout << "connect to " << remote::hostPort (server) << endl;
-			string reply = remote::eval (server, remote::bind (FUN(echo), line));
+			string reply = remote::eval (remote::bind (FUN(echo), line), server);
 			cout << reply << endl;
 		} catch (std::exception &e) {
 			cerr << e.what() << endl;
@@ -36,12 +62,171 @@ void mainServer (unsigned short localPort) {
 	t->join();  // wait forever
 }
 
-static string usage = "Try `remote server <port>` or `remote client <hostname>:<port>`";
+/* Load */
+
+struct Load {
+	remote::Host server;
+	unsigned concurrency;
+	double qps;  // 0 for closed loop
+	double seconds;
+	unsigned bytes;
+	unsigned spinMicros;  // of each spin call
+	vector < pair <string, unsigned> > mix;  // function name and weight
+	Load () : concurrency (8), qps (0), seconds (10), bytes (64), spinMicros (100) {mix.push_back (make_pair ("bounce", 1));}
+};
+
+/** Latencies of successful calls of one client thread, in nanoseconds */
+struct Samples {
+	vector<long long> measured;  // from when call was sent
+	vector<long long> corrected;  // from when call should have been sent (open loop only)
+	long errors;
+	Samples () : errors (0) {}
+};
+
+static long long now () {
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return (long long) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void sleepUntil (long long t) {
+	struct timespec ts;
+	ts.tv_sec = t / 1000000000;
+	ts.tv_nsec = t % 1000000000;
+	clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+}
+
+/** Call function i of the mix, picked by weight with counter */
+static void callMix (const Load &load, unsigned long n, const string &payload) {
+	unsigned total = 0;
+	for (unsigned i = 0; i < load.mix.size(); i++) total += load.mix[i].second;
+	unsigned pick = n % total;
+	unsigned i = 0;
+	while (pick >= load.mix[i].second) pick -= load.mix[i++].second;
+	const string &f = load.mix[i].first;
+	if (f == "bounce") remote::eval (remote::bind (FUN(bounce), payload), load.server);
+	else if (f == "length") remote::eval (remote::bind (FUN(length), payload), load.server);
+	else remote::eval (remote::bind (FUN(spin), payload, load.spinMicros), load.server);
+}
+
+/** Calls in flight or done, shared by client threads. Call n is due at start + n / qps in open loop */
+static unsigned long nextCall = 0;
+
+static void client (const Load &load, long long start, long long end, Samples &samples) {
+	string payload (load.bytes, 'x');
+	for (;;) {
+		unsigned long n = __sync_fetch_and_add (&nextCall, 1);
+		long long due = load.qps > 0 ? start + (long long) (n * 1e9 / load.qps) : 0;
+		if (due >= end) return;
+		if (due > 0) sleepUntil (due);
+		long long sent = now();
+		if (sent >= end) return;
+		try {callMix (load, n, payload);}
+		catch (std::exception &e) { // eg. refused: fast, so it would skew latencies and throughput
+			samples.errors++;
+			continue;
+		}
+		long long done = now();
+		samples.measured.push_back (done - sent);
+		if (due > 0) samples.corrected.push_back (done - due);
+	}
+}
+
+/** Add the calls a closed loop would have sent every interval while waiting on a slow one, had it not waited (as HdrHistogram does) */
+static vector<long long> backfill (const vector<long long> &measured, long long interval) {
+	vector<long long> corrected (measured);
+	if (interval <= 0) return corrected;
+	for (unsigned i = 0; i < measured.size(); i++)
+		for (long long v = measured[i] - interval; v >= interval; v -= interval) corrected.push_back (v);
+	return corrected;
+}
+
+static double percentile (const vector<long long> &sorted, double p) {
+	if (sorted.empty()) return 0;
+	unsigned i = min ((size_t) (p * sorted.size()), sorted.size() - 1);
+	return sorted[i] / 1000.0;
+}
+
+static void report (string name, vector<long long> latencies) {
+	sort (latencies.begin(), latencies.end());
+	printf ("%-10s p50 %9.1fus  p90 %9.1fus  p99 %9.1fus  p999 %9.1fus  max %9.1fus\n", name.c_str(),
+		percentile (latencies, 0.5), percentile (latencies, 0.9), percentile (latencies, 0.99), percentile (latencies, 0.999), latencies.empty() ? 0 : latencies.back() / 1000.0);
+}
+
+void mainLoad (const Load &load) {
+	remote::eval (remote::bind (FUN(bounce), string ("warm up")), load.server); // load stubs before timing
+	vector<Samples> samples (load.concurrency);
+	long long start = now() + 1000000, end = start + (long long) (load.seconds * 1e9);
+	boost::thread_group threads;
+	for (unsigned i = 0; i < load.concurrency; i++)
+		threads.create_thread (boost::bind (client, boost::cref (load), start, end, boost::ref (samples[i])));
+	threads.join_all();
+	double elapsed = (now() - start) / 1e9;
+	vector<long long> measured, corrected;
+	long errors = 0;
+	for (unsigned i = 0; i < samples.size(); i++) {
+		measured.insert (measured.end(), samples[i].measured.begin(), samples[i].measured.end());
+		corrected.insert (corrected.end(), samples[i].corrected.begin(), samples[i].corrected.end());
+		errors += samples[i].errors;
+	}
+	if (load.qps == 0 && !measured.empty()) { // expected interval between calls of a thread is the typical latency
+		vector<long long> sorted (measured);
+		nth_element (sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+		corrected = backfill (measured, sorted [sorted.size() / 2]);
+	}
+	printf ("%s loop, %u threads%s, %u byte payloads, %.1fs\n", load.qps > 0 ? "open" : "closed", load.concurrency,
+		load.qps > 0 ? (", target " + to_string (load.qps) + " calls/s") .c_str() : "", load.bytes, elapsed);
+	printf ("%lu calls ok, %ld errors, %.1f ok calls/s\n", (unsigned long) measured.size(), errors, measured.size() / elapsed);
+	report ("measured", measured);
+	report ("corrected", corrected);
+}
+
+/** "f=w,g=v" into function names and weights */
+static vector < pair <string, unsigned> > parseMix (string s) {
+	vector < pair <string, unsigned> > mix;
+	vector<string> items = split_string (',', s);
+	for (unsigned i = 0; i < items.size(); i++) {
+		vector<string> fw = split_string ('=', items[i]);
+		if (fw[0] != "bounce" && fw[0] != "length" && fw[0] != "spin") throw std::runtime_error ("Unknown function in mix: " + fw[0]);
+		mix.push_back (make_pair (fw[0], fw.size() < 2 ? 1 : parse_string<unsigned> (fw[1])));
+	}
+	unsigned total = 0;
+	for (unsigned i = 0; i < mix.size(); i++) total += mix[i].second;
+	if (total == 0) throw std::runtime_error ("Weights of mix are all zero: " + s);
+	return mix;
+}
+
+static Load parseLoad (int argc, const char* argv[]) {
+	Load load;
+	load.server = argv[2];
+	for (int i = 3; i < argc; i += 2) {
+		if (i + 1 == argc) throw std::runtime_error ("Missing value of option " + string (argv[i]));
+		string flag = argv[i], value = argv[i+1];
+		if (flag == "-c") load.concurrency = parse_string<unsigned> (value);
+		else if (flag == "-qps") load.qps = parse_string<double> (value);
+		else if (flag == "-d") load.seconds = parse_string<double> (value);
+		else if (flag == "-b") load.bytes = parse_string<unsigned> (value);
+		else if (flag == "-w") load.spinMicros = parse_string<unsigned> (value);
+		else if (flag == "-mix") load.mix = parseMix (value);
+		else throw std::runtime_error ("Unknown option " + flag);
+	}
+	return load;
+}
+
+static string usage = "Try `remote server <port>`, `remote client <hostname>:<port>`, or `remote load <hostname>:<port> [-c concurrency] [-qps rate] [-d seconds] [-b payload-bytes] [-w spin-micros] [-mix bounce=8,length=1,spin=1]`";
 
 int main (int argc, const char* argv[]) {
 	if (argc == 3 && string(argv[1]) == "server")
 		mainServer (parse_string<unsigned short> (argv[2]));
 	else if (argc == 3 && string(argv[1]) == "client")
 		mainClient (argv[2]);
-	else cerr << usage << endl;
+	else if (argc >= 3 && string(argv[1]) == "load") {
+		Load load;
+		try {load = parseLoad (argc, argv);}
+		catch (std::exception &e) {
+			cerr << e.what() << endl << usage << endl;
+			return 1;
+		}
+		mainLoad (load);
+	} else cerr << usage << endl;
 }
@@ -0,0 +1,25 @@
+/* Compile the stubs of every function in a manifest into one shared library, for servers to preload (see manifest.h).
+ * Run as: `stubgen <manifest> [<library>]`. Library defaults to <manifest>.so */
+
+#include <iostream>
+#include "manifest.h"
+
+using namespace std;
+
+static string usage = "Try `stubgen <manifest> [<library>]`";
+
+int main (int argc, const char* argv[]) {
+	if (argc < 2 || argc > 3) {
+		cerr << usage << endl;
+		return 1;
+	}
+	string lib = argc == 3 ? string (argv[2]) : manifest::library (argv[1]);
+	try {
+		manifest::build (argv[1], lib);
+	} catch (std::exception &e) {
+		cerr << e.what() << endl;
+		return 1;
+	}
+	cout << lib << endl;
+	return 0;
+}